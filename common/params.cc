@@ -3,7 +3,15 @@
 #include <dirent.h>
 #include <sys/file.h>
 
+#ifndef __APPLE__
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
+
 #include <algorithm>
+#include <cmath>
+#include <condition_variable>
 #include <csignal>
 #include <unordered_map>
 
@@ -69,6 +77,60 @@ std::string ensure_params_path(const std::string &prefix, const std::string &pat
   return params_path;
 }
 
+// Write value to a new temp file in dir and fsync it. tmp_path is set once the file exists.
+int write_tmp_value(const std::string &dir, const char *value, size_t value_size, std::string &tmp_path) {
+  std::string path = dir + "/.tmp_value_XXXXXX";
+  int tmp_fd = mkstemp((char*)path.c_str());
+  if (tmp_fd < 0) return -1;
+  tmp_path = path;
+
+  int result = 0;
+  ssize_t bytes_written = HANDLE_EINTR(write(tmp_fd, value, value_size));
+  if (bytes_written < 0 || (size_t)bytes_written != value_size) {
+    result = -20;
+  } else {
+    // fsync to force persist the changes.
+    result = fsync(tmp_fd);
+  }
+  close(tmp_fd);
+  return result;
+}
+
+// Wakes up a waiter as soon as a file is moved or written into the directory
+class DirWatch {
+public:
+  DirWatch(const std::string &path) {
+#ifndef __APPLE__
+    fd_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd_ >= 0 && inotify_add_watch(fd_, path.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+#endif
+  }
+  ~DirWatch() {
+    if (fd_ >= 0) close(fd_);
+  }
+
+  // returns early on a change or a signal, falls back to sleeping without inotify
+  void wait(int timeout_ms) {
+#ifndef __APPLE__
+    if (fd_ >= 0) {
+      struct pollfd pfd = {.fd = fd_, .events = POLLIN};
+      if (poll(&pfd, 1, timeout_ms) > 0) {
+        alignas(struct inotify_event) char buf[4096];
+        while (read(fd_, buf, sizeof(buf)) > 0) {}
+      }
+      return;
+    }
+#endif
+    util::sleep_for(timeout_ms);
+  }
+
+private:
+  int fd_ = -1;
+};
+
 class FileLock {
 public:
   FileLock(const std::string &fn) {
@@ -210,10 +272,218 @@ std::unordered_map<std::string, uint32_t> keys = {
 
 } // namespace
 
+// Decoded values of one params directory, shared by all cached Params in the process.
+// A watcher thread drops entries as soon as inotify reports the file was replaced or removed.
+class ParamsCache {
+public:
+  static ParamsCache *get(const std::string &dir, bool create) {
+    static std::mutex registry_lock;
+    static std::unordered_map<std::string, std::unique_ptr<ParamsCache>> registry;
+
+    std::lock_guard lk(registry_lock);
+    auto it = registry.find(dir);
+    if (it != registry.end()) return it->second.get();
+    if (!create) return nullptr;
+    return (registry[dir] = std::make_unique<ParamsCache>(dir)).get();
+  }
+
+  ParamsCache(const std::string &dir) : dir(dir) {
+#ifndef __APPLE__
+    inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (inotify_fd >= 0 && wake_fd >= 0 &&
+        inotify_add_watch(inotify_fd, dir.c_str(), IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE |
+                          IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF) >= 0) {
+      valid = true;
+      watcher = std::thread(&ParamsCache::watcherThread, this);
+    } else {
+      LOGE("Failed to watch params directory %s, errno=%d", dir.c_str(), errno);
+    }
+#endif
+  }
+
+  ~ParamsCache() {
+    if (watcher.joinable()) {
+      uint64_t one = 1;
+      exit = true;
+      HANDLE_EINTR(write(wake_fd, &one, sizeof(one)));
+      watcher.join();
+    }
+    if (inotify_fd >= 0) close(inotify_fd);
+    if (wake_fd >= 0) close(wake_fd);
+  }
+
+  std::string read(const std::string &key) {
+    uint64_t gen = 0;
+    {
+      std::lock_guard lk(lock);
+      if (!valid) return util::read_file(dir + "/" + key);
+
+      auto it = values.find(key);
+      if (it != values.end()) return it->second;
+      gen = generation;
+    }
+
+    // only insert if nothing changed while reading, otherwise a stale value could stick
+    std::string value = util::read_file(dir + "/" + key);
+    std::lock_guard lk(lock);
+    if (valid && gen == generation) {
+      values[key] = value;
+    }
+    return value;
+  }
+
+  void invalidate(const std::string &key = {}) {
+    std::lock_guard lk(lock);
+    if (key.empty()) {
+      values.clear();
+    } else {
+      values.erase(key);
+    }
+    ++generation;
+  }
 
-Params::Params(const std::string &path) {
+private:
+#ifndef __APPLE__
+  void watcherThread() {
+    util::set_thread_name("params_cache");
+
+    alignas(struct inotify_event) char buf[4096];
+    struct pollfd fds[] = {{.fd = inotify_fd, .events = POLLIN}, {.fd = wake_fd, .events = POLLIN}};
+    while (!exit) {
+      if (HANDLE_EINTR(poll(fds, std::size(fds), -1)) < 0) break;
+
+      ssize_t len;
+      while ((len = HANDLE_EINTR(::read(inotify_fd, buf, sizeof(buf)))) > 0) {
+        std::lock_guard lk(lock);
+        for (char *p = buf; p < buf + len;) {
+          auto event = (const struct inotify_event *)p;
+          if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+            // lost events or the directory itself is gone, stop caching
+            values.clear();
+            valid = !(event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF));
+          } else if (event->len > 0) {
+            values.erase(event->name);
+          }
+          p += sizeof(struct inotify_event) + event->len;
+        }
+        ++generation;
+      }
+    }
+  }
+#endif
+
+  const std::string dir;
+  std::mutex lock;
+  std::unordered_map<std::string, std::string> values;
+  uint64_t generation = 0;
+  bool valid = false;
+
+  int inotify_fd = -1;
+  int wake_fd = -1;
+  std::atomic<bool> exit = false;
+  std::thread watcher;
+};
+
+// Background writer shared by the process for putNonBlocking(). Pending values are coalesced
+// per key and each batch is committed as one Params::Transaction per params directory.
+class ParamsWriter {
+public:
+  static ParamsWriter &instance() {
+    static ParamsWriter writer;
+    return writer;
+  }
+
+  ParamsWriter() {
+    // the writer invalidates the caches while it drains at exit. statics are destroyed in the
+    // reverse order they were created, so create the cache registry first to outlive the writer
+    ParamsCache::get({}, false);
+    thread = std::thread(&ParamsWriter::writerThread, this);
+  }
+
+  ~ParamsWriter() {
+    {
+      std::lock_guard lk(lock);
+      exit = true;
+    }
+    cv.notify_one();
+    thread.join();
+  }
+
+  bool push(const std::string &params_path, const std::string &key, const std::string &value) {
+    {
+      std::lock_guard lk(lock);
+      auto [it, inserted] = pending.try_emplace({params_path, key}, value);
+      if (!inserted) {
+        it->second = value;
+      } else if (pending.size() > MAX_PENDING) {
+        pending.erase(it);
+        LOGE("params writer queue full, dropping %s", key.c_str());
+        return false;
+      }
+    }
+    cv.notify_one();
+    return true;
+  }
+
+  void flush() {
+    std::unique_lock lk(lock);
+    idle_cv.wait(lk, [this] { return pending.empty() && !writing; });
+  }
+
+private:
+  void writerThread() {
+    util::set_thread_name("params_writer");
+
+    std::unique_lock lk(lock);
+    while (true) {
+      cv.wait(lk, [this] { return exit || !pending.empty(); });
+      if (pending.empty()) break;
+
+      auto batch = std::move(pending);
+      pending.clear();
+      writing = true;
+      lk.unlock();
+
+      for (auto it = batch.begin(); it != batch.end();) {
+        const std::string params_path = it->first.first;
+        try {
+          Params params(params_path);
+          Params::Transaction tx(params);
+          for (; it != batch.end() && it->first.first == params_path; ++it) {
+            tx.put(it->first.second, it->second);
+          }
+          if (tx.commit() != 0) {
+            LOGE("params writer failed to write to %s, errno=%d", params_path.c_str(), errno);
+          }
+        } catch (std::exception &e) {
+          LOGE("params writer: %s", e.what());
+          while (it != batch.end() && it->first.first == params_path) ++it;
+        }
+      }
+
+      lk.lock();
+      writing = false;
+      idle_cv.notify_all();
+    }
+  }
+
+  static constexpr size_t MAX_PENDING = 256;
+  std::mutex lock;
+  std::condition_variable cv, idle_cv;
+  // (params path, key) -> latest value
+  std::map<std::pair<std::string, std::string>, std::string> pending;
+  bool writing = false;
+  bool exit = false;
+  std::thread thread;
+};
+
+Params::Params(const std::string &path, bool cached) {
   prefix = "/" + util::getenv("OPENPILOT_PREFIX", "d");
   params_path = ensure_params_path(prefix, path);
+  if (cached) {
+    cache = ParamsCache::get(getParamPath(), true);
+  }
 }
 
 std::vector<std::string> Params::allKeys() const {
@@ -239,60 +509,117 @@ int Params::put(const char* key, const char* value, size_t value_size) {
   // 3) fsync() the temp file
   // 4) rename the temp file to the real name
   // 5) fsync() the containing directory
-  std::string tmp_path = params_path + "/.tmp_value_XXXXXX";
-  int tmp_fd = mkstemp((char*)tmp_path.c_str());
-  if (tmp_fd < 0) return -1;
+  std::string tmp_path;
+  int result = write_tmp_value(params_path, value, value_size, tmp_path);
+  if (result == 0) {
+    FileLock file_lock(params_path + "/.lock");
 
-  int result = -1;
-  do {
-    // Write value to temp.
-    ssize_t bytes_written = HANDLE_EINTR(write(tmp_fd, value, value_size));
-    if (bytes_written < 0 || (size_t)bytes_written != value_size) {
-      result = -20;
-      break;
+    // Move temp into place.
+    if ((result = rename(tmp_path.c_str(), getParamPath(key).c_str())) == 0) {
+      // fsync parent directory
+      result = fsync_dir(getParamPath());
     }
+  }
 
-    // fsync to force persist the changes.
-    if ((result = fsync(tmp_fd)) < 0) break;
+  if (!tmp_path.empty()) ::unlink(tmp_path.c_str());
 
-    FileLock file_lock(params_path + "/.lock");
+  // make the new value visible to cached readers in this process right away
+  if (ParamsCache *c = ParamsCache::get(getParamPath(), false)) {
+    c->invalidate(key);
+  }
+  return result;
+}
 
-    // Move temp into place.
-    if ((result = rename(tmp_path.c_str(), getParamPath(key).c_str())) < 0) break;
+int Params::Transaction::commit() {
+  if (ops.empty()) return 0;
+
+  // Same steps as put(), but every value is written and fsynced before taking the lock once,
+  // and the directory is only fsynced after all renames and unlinks.
+  std::vector<std::pair<std::string, std::string>> tmp_files;  // key, temp path
+  int result = 0;
+  for (auto &[key, value] : ops) {
+    if (!value) continue;
+    std::string tmp_path;
+    result = write_tmp_value(params.params_path, value->data(), value->size(), tmp_path);
+    if (!tmp_path.empty()) tmp_files.push_back({key, tmp_path});
+    if (result != 0) break;
+  }
 
-    // fsync parent directory
-    result = fsync_dir(getParamPath());
-  } while (false);
+  if (result == 0) {
+    FileLock file_lock(params.params_path + "/.lock");
 
-  close(tmp_fd);
-  ::unlink(tmp_path.c_str());
+    for (auto &[key, tmp_path] : tmp_files) {
+      if ((result = rename(tmp_path.c_str(), params.getParamPath(key).c_str())) < 0) break;
+    }
+    for (auto &[key, value] : ops) {
+      if (result == 0 && !value && unlink(params.getParamPath(key).c_str()) != 0 && errno != ENOENT) {
+        result = -1;
+      }
+    }
+
+    // fsync parent directory once for all changes
+    int sync_result = fsync_dir(params.getParamPath());
+    if (result == 0) result = sync_result;
+  }
+
+  for (auto &[key, tmp_path] : tmp_files) {
+    ::unlink(tmp_path.c_str());
+  }
+
+  if (ParamsCache *c = ParamsCache::get(params.getParamPath(), false)) {
+    c->invalidate();
+  }
+  ops.clear();
   return result;
 }
 
 int Params::remove(const std::string &key) {
   FileLock file_lock(params_path + "/.lock");
   int result = unlink(getParamPath(key).c_str());
+  if (ParamsCache *c = ParamsCache::get(getParamPath(), false)) {
+    c->invalidate(key);
+  }
   if (result != 0) {
     return result;
   }
   return fsync_dir(getParamPath());
 }
 
-std::string Params::get(const std::string &key, bool block) {
+bool Params::putNonBlocking(const std::string &key, const std::string &val) {
+  return ParamsWriter::instance().push(params_path, key, val);
+}
+
+void Params::flushNonBlocking() {
+  ParamsWriter::instance().flush();
+}
+
+std::string Params::get(const std::string &key, bool block, int timeout_ms) {
   if (!block) {
-    return util::read_file(getParamPath(key));
+    return cache ? cache->read(key) : util::read_file(getParamPath(key));
   } else {
-    // blocking read until successful
+    // blocking read until successful, interrupted by SIGINT/SIGTERM or the timeout
     params_do_exit = 0;
     void (*prev_handler_sigint)(int) = std::signal(SIGINT, params_sig_handler);
     void (*prev_handler_sigterm)(int) = std::signal(SIGTERM, params_sig_handler);
 
+    // watch before the first read, so a rename landing in between isn't missed
+    DirWatch watch(getParamPath());
+    const double deadline = millis_since_boot() + timeout_ms;
+
     std::string value;
     while (!params_do_exit) {
       if (value = util::read_file(getParamPath(key)); !value.empty()) {
         break;
       }
-      util::sleep_for(100);  // 0.1 s
+
+      // still wake up periodically, a signal can arrive right before waiting
+      int wait_ms = 100;
+      if (timeout_ms >= 0) {
+        double remaining = deadline - millis_since_boot();
+        if (remaining <= 0) break;
+        wait_ms = std::min(wait_ms, (int)std::ceil(remaining));
+      }
+      watch.wait(wait_ms);
     }
 
     std::signal(SIGINT, prev_handler_sigint);
@@ -325,4 +652,7 @@ void Params::clearAll(ParamKeyType key_type) {
   }
 
   fsync_dir(getParamPath());
+  if (ParamsCache *c = ParamsCache::get(getParamPath(), false)) {
+    c->invalidate();
+  }
 }
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <map>
+#include <optional>
 #include <string>
 #include <vector>
 
+class ParamsCache;
+
 enum ParamKeyType {
   PERSISTENT = 0x02,
   CLEAR_ON_MANAGER_START = 0x04,
@@ -15,7 +18,8 @@ enum ParamKeyType {
 
 class Params {
 public:
-  Params(const std::string &path = {});
+  // cached: serve get() from an in-process cache, invalidated through inotify on the params directory
+  Params(const std::string &path = {}, bool cached = false);
   std::vector<std::string> allKeys() const;
   bool checkKey(const std::string &key);
   ParamKeyType getKeyType(const std::string &key);
@@ -28,9 +32,10 @@ public:
   void clearAll(ParamKeyType type);
 
   // helpers for reading values
-  std::string get(const std::string &key, bool block = false);
-  inline bool getBool(const std::string &key, bool block = false) {
-    return get(key, block) == "1";
+  // block: wait until the key is written, or until timeout_ms if it isn't negative
+  std::string get(const std::string &key, bool block = false, int timeout_ms = -1);
+  inline bool getBool(const std::string &key, bool block = false, int timeout_ms = -1) {
+    return get(key, block, timeout_ms) == "1";
   }
   std::map<std::string, std::string> readAll();
 
@@ -43,7 +48,36 @@ public:
     return put(key.c_str(), val ? "1" : "0", 1);
   }
 
+  // Queue the write on a background thread shared by the process, for callers that can't block on storage.
+  // Repeated writes to a key are coalesced and everything pending is flushed when static objects are
+  // destroyed, processes that exit without that (_exit, fork) must call flushNonBlocking() first.
+  // Returns false if the queue is full.
+  bool putNonBlocking(const std::string &key, const std::string &val);
+  inline bool putBoolNonBlocking(const std::string &key, bool val) {
+    return putNonBlocking(key, val ? "1" : "0");
+  }
+  // Wait until all queued non-blocking writes are on disk
+  static void flushNonBlocking();
+
+  // Stages many puts and removes, then applies them under one lock with a single directory fsync.
+  // The batch isn't atomic: each key is still renamed on its own, so a crash in commit() can leave
+  // some keys updated and others not. Every value is either the old or the new one, never truncated.
+  class Transaction {
+  public:
+    Transaction(Params &params) : params(params) {}
+    inline void put(const std::string &key, const std::string &val) { ops[key] = val; }
+    inline void putBool(const std::string &key, bool val) { ops[key] = val ? "1" : "0"; }
+    inline void remove(const std::string &key) { ops[key] = std::nullopt; }
+    int commit();
+
+  private:
+    Params &params;
+    // last staged value wins, std::nullopt removes the key
+    std::map<std::string, std::optional<std::string>> ops;
+  };
+
 private:
   std::string params_path;
   std::string prefix;
+  ParamsCache *cache = nullptr;
 };
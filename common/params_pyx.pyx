@@ -25,6 +25,12 @@ cdef extern from "common/params.h":
     void clearAll(ParamKeyType)
     vector[string] allKeys()
 
+  cdef cppclass c_Transaction "Params::Transaction":
+    c_Transaction(c_Params&) nogil
+    void put(string, string) nogil
+    void remove(string) nogil
+    int commit() nogil
+
 
 def ensure_bytes(v):
   return v.encode() if isinstance(v, str) else v;
@@ -97,6 +103,27 @@ cdef class Params:
     with nogil:
       self.p.remove(k)
 
+  def put_many(self, values, removes=()):
+    """
+    Writes the values of a dict and removes the keys in removes with one lock and one directory
+    fsync, instead of one per key. Like put(), this blocks until everything is on disk.
+    Not atomic, after a crash some keys can have the new values and others the old ones.
+    """
+    cdef c_Transaction *tx = new c_Transaction(self.p[0])
+    cdef string k, dat_bytes
+    try:
+      for key, dat in values.items():
+        k = self.check_key(key)
+        dat_bytes = (b"1" if dat else b"0") if isinstance(dat, bool) else ensure_bytes(dat)
+        tx.put(k, dat_bytes)
+      for key in removes:
+        k = self.check_key(key)
+        tx.remove(k)
+      with nogil:
+        tx.commit()
+    finally:
+      del tx
+
   def get_param_path(self, key=""):
     cdef string key_bytes = ensure_bytes(key)
     return self.p.getParamPath(key_bytes).decode("utf-8")
@@ -104,6 +131,8 @@ cdef class Params:
   def all_keys(self):
     return self.p.allKeys()
 
+# not Params::putNonBlocking: its writer is flushed by static destructors, which processes started
+# by multiprocessing skip (os._exit), and its thread doesn't survive a fork. the thread is joined on exit.
 def put_nonblocking(key, val, d=""):
   threading.Thread(target=lambda: Params(d).put(key, val)).start()
 
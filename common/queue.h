@@ -1,6 +1,9 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <mutex>
 #include <queue>
 
@@ -50,3 +53,139 @@ private:
   std::condition_variable cv;
   std::queue<T> q;
 };
+
+// Bounded lock-free ring buffer with a single consumer, usable in place of SafeQueue on frame paths.
+// The producer side is wait-free for one producer (RingQueue<T, N>) and lock-free for many
+// (RingQueue<T, N, true>). The mutex is only touched when a thread has to sleep on an empty or full queue.
+template <class T, size_t N, bool MultiProducer = false>
+class RingQueue {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "capacity must be a power of two");
+
+public:
+  RingQueue() {
+    for (size_t i = 0; i < N; ++i) {
+      cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // blocks while the queue is full
+  void push(const T& v) {
+    while (!try_push(v)) {
+      wait([this] { return size() < N; }, -1);
+    }
+  }
+
+  bool try_push(const T& v) {
+    return try_push_with([&v](T& slot) { slot = v; });
+  }
+
+  // fill the claimed slot in place, saves a copy for large T
+  template <class F>
+  bool try_push_with(F&& fill) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &cells[pos & (N - 1)];
+      intptr_t dif = (intptr_t)cell->seq.load(std::memory_order_acquire) - (intptr_t)pos;
+      if (dif < 0) return false;  // full
+      if (dif == 0) {
+        if constexpr (MultiProducer) {
+          if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else {
+          tail.store(pos + 1, std::memory_order_relaxed);
+          break;
+        }
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+    fill(cell->value);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    notify();
+    return true;
+  }
+
+  T pop() {
+    T v;
+    while (!try_pop(v)) {
+      wait([this] { return !empty(); }, -1);
+    }
+    return v;
+  }
+
+  bool try_pop(T& v, int timeout_ms = 0) {
+    return try_pop_with([&v](T& slot) { v = std::move(slot); }, timeout_ms);
+  }
+
+  // hand the slot to consume in place before releasing it to the producers
+  template <class F>
+  bool try_pop_with(F&& consume, int timeout_ms = 0) {
+    if (pop_one(consume)) return true;
+    if (timeout_ms <= 0) return false;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    do {
+      auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+      if (remaining.count() <= 0 || !wait([this] { return !empty(); }, remaining.count())) return false;
+    } while (!pop_one(consume));
+    return true;
+  }
+
+  bool empty() const { return size() == 0; }
+  size_t size() const {
+    size_t h = head.load(std::memory_order_acquire);
+    size_t t = tail.load(std::memory_order_acquire);
+    return t > h ? t - h : 0;
+  }
+  static constexpr size_t capacity() { return N; }
+
+private:
+  template <class F>
+  bool pop_one(F& consume) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    Cell *cell = &cells[pos & (N - 1)];
+    if ((intptr_t)cell->seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1) < 0) return false;
+
+    consume(cell->value);
+    head.store(pos + 1, std::memory_order_release);
+    cell->seq.store(pos + N, std::memory_order_release);
+    notify();
+    return true;
+  }
+
+  template <class Pred>
+  bool wait(Pred pred, int timeout_ms) {
+    // announce the waiter before checking pred, see notify()
+    waiters.fetch_add(1, std::memory_order_seq_cst);
+    std::unique_lock lk(m);
+    bool ret = true;
+    if (timeout_ms < 0) {
+      cv.wait(lk, pred);
+    } else {
+      ret = cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), pred);
+    }
+    waiters.fetch_sub(1, std::memory_order_relaxed);
+    return ret;
+  }
+
+  inline void notify() {
+    // pairs with the increment in wait(): either the waiter sees the change or we see the waiter
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed) > 0) {
+      { std::lock_guard lk(m); }
+      cv.notify_all();
+    }
+  }
+
+  struct Cell {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  alignas(64) std::atomic<size_t> head = 0;
+  alignas(64) std::atomic<size_t> tail = 0;
+  alignas(64) std::atomic<int> waiters = 0;
+  std::mutex m;
+  std::condition_variable cv;
+  Cell cells[N];
+};
@@ -3,45 +3,230 @@
 #endif
 
 #include "common/statlog.h"
+#include "common/timing.h"
 #include "common/util.h"
 
-#include <cstdarg>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <set>
 #include <stdio.h>
-#include <mutex>
+#include <string_view>
 #include <zmq.h>
 
+// wire type of aggregated samples: "name:count,sum,min,max|ag|bucket:count,bucket:count"
+#define STATLOG_AGGREGATE "ag"
+
+struct Metric {
+  char type = 0;
+  uint64_t updated = 0;  // gauges: nanos_since_boot of the last value
+  double value = 0;      // gauges: last value, counts: sum
+  // samples
+  uint32_t count = 0;
+  double sum = 0;
+  double min = std::numeric_limits<double>::max();
+  double max = std::numeric_limits<double>::lowest();
+  std::map<double, uint32_t> histogram;  // bucket -> count, nodes are kept across flushes
+
+  void add(double v) {
+    // NaN would break the ordering of the histogram, and either would poison the sum
+    if (!std::isfinite(v)) return;
+
+    if (type == 'g') {
+      value = v;
+      updated = nanos_since_boot();
+    } else if (type == 'c') {
+      value += v;
+      ++count;
+    } else {
+      ++count;
+      sum += v;
+      min = std::min(min, v);
+      max = std::max(max, v);
+      ++histogram[bucket(v)];
+    }
+  }
+
+  void merge(Metric &other) {
+    if (other.count == 0 && other.updated == 0) return;
+
+    if (type == 'g') {
+      if (other.updated >= updated) {
+        value = other.value;
+        updated = other.updated;
+      }
+    } else {
+      value += other.value;
+      count += other.count;
+      sum += other.sum;
+      min = std::min(min, other.min);
+      max = std::max(max, other.max);
+      for (auto &[b, cnt] : other.histogram) {
+        if (cnt > 0) histogram[b] += cnt;
+      }
+    }
+    other.reset();
+  }
+
+  void reset() {
+    updated = 0;
+    value = 0;
+    count = 0;
+    sum = 0;
+    min = std::numeric_limits<double>::max();
+    max = std::numeric_limits<double>::lowest();
+    for (auto &[b, cnt] : histogram) cnt = 0;
+  }
+
+  // 4 buckets per octave, each bucket is represented by its lower bound
+  static double bucket(double v) {
+    if (v == 0) return v;
+    return std::copysign(std::exp2(std::floor(std::log2(std::fabs(v)) * 4) / 4), v);
+  }
+};
+
+// std::less<> allows looking up metric names without constructing a std::string
+typedef std::map<std::string, Metric, std::less<>> MetricMap;
+
+struct ThreadMetrics {
+  ThreadMetrics();
+  ~ThreadMetrics();
+
+  std::mutex lock;  // only contended while the flush thread collects
+  MetricMap metrics;
+};
+
 class StatlogState : public LogState {
   public:
     StatlogState() : LogState("ipc:///tmp/stats") {}
+
+    ~StatlogState() {
+      if (flush_thread.joinable()) {
+        {
+          std::lock_guard lk(lock);
+          exit = true;
+        }
+        cv.notify_one();
+        flush_thread.join();
+      }
+    }
+
+    void start() {
+      std::lock_guard lk(lock);
+      if (!initialized) {
+        initialize();
+        flush_thread = std::thread(&StatlogState::flushThread, this);
+      }
+    }
+
+    void add(ThreadMetrics *t) {
+      std::lock_guard lk(lock);
+      threads.insert(t);
+    }
+
+    void remove(ThreadMetrics *t) {
+      std::scoped_lock lk(lock, t->lock);
+      collect(t->metrics, retired);
+      threads.erase(t);
+    }
+
+    // merge all threads into one batch message, the socket is only used here under lock
+    void flush() {
+      std::lock_guard lk(lock);
+      for (auto t : threads) {
+        std::lock_guard tlk(t->lock);
+        collect(t->metrics, pending);
+      }
+      collect(retired, pending);
+      std::string batch = format(pending);
+      if (!batch.empty()) {
+        zmq_send(sock, batch.data(), batch.size(), ZMQ_NOBLOCK);
+      }
+    }
+
+  private:
+    void flushThread() {
+      util::set_thread_name("statlog");
+      std::unique_lock lk(lock);
+      while (!exit) {
+        cv.wait_for(lk, std::chrono::milliseconds(STATLOG_FLUSH_INTERVAL_MS), [this] { return exit; });
+        lk.unlock();
+        flush();
+        lk.lock();
+      }
+    }
+
+    static void collect(MetricMap &from, MetricMap &to) {
+      for (auto &[name, m] : from) {
+        auto it = to.find(name);
+        if (it == to.end()) {
+          it = to.emplace(name, Metric{.type = m.type}).first;
+        }
+        it->second.merge(m);
+      }
+    }
+
+    static std::string format(MetricMap &metrics) {
+      std::string batch;
+      for (auto &[name, m] : metrics) {
+        if (m.type == 'g' && m.updated != 0) {
+          batch += util::string_format("%s:%f|%s\n", name.c_str(), m.value, STATLOG_GAUGE);
+        } else if (m.type == 'c' && m.count > 0) {
+          batch += util::string_format("%s:%f|%s\n", name.c_str(), m.value, STATLOG_COUNT);
+        } else if (m.type == 's' && m.count > 0) {
+          batch += util::string_format("%s:%u,%f,%f,%f|%s|", name.c_str(), m.count, m.sum, m.min, m.max, STATLOG_AGGREGATE);
+          for (auto &[b, cnt] : m.histogram) {
+            if (cnt > 0) batch += util::string_format("%g:%u,", b, cnt);
+          }
+          batch.back() = '\n';
+        }
+        m.reset();
+      }
+      if (!batch.empty()) batch.pop_back();
+      return batch;
+    }
+
+    std::condition_variable cv;
+    bool exit = false;
+    std::thread flush_thread;
+    std::set<ThreadMetrics *> threads;
+    MetricMap retired;  // from exited threads
+    MetricMap pending;
 };
 
 static StatlogState s = {};
 
-static void log(const char* metric_type, const char* metric, const char* fmt, ...) {
-  std::lock_guard lk(s.lock);
-  if (!s.initialized) s.initialize();
+ThreadMetrics::ThreadMetrics() {
+  s.start();
+  s.add(this);
+}
+
+ThreadMetrics::~ThreadMetrics() {
+  s.remove(this);
+}
 
-  char* value_buf = nullptr;
-  va_list args;
-  va_start(args, fmt);
-  int ret = vasprintf(&value_buf, fmt, args);
-  va_end(args);
+static void log(const char* metric_type, const char* metric, double value) {
+  thread_local ThreadMetrics t;
 
-  if (ret > 0 && value_buf) {
-    char* line_buf = nullptr;
-    ret = asprintf(&line_buf, "%s:%s|%s", metric, value_buf, metric_type);
-    if (ret > 0 && line_buf) {
-      zmq_send(s.sock, line_buf, ret, ZMQ_NOBLOCK);
-      free(line_buf);
-    }
-    free(value_buf);
+  std::lock_guard lk(t.lock);
+  auto it = t.metrics.find(std::string_view(metric));
+  if (it == t.metrics.end()) {
+    it = t.metrics.emplace(metric, Metric{.type = metric_type[0]}).first;
   }
+  it->second.add(value);
 }
 
 void statlog_log(const char* metric_type, const char* metric, int value) {
-  log(metric_type, metric, "%d", value);
+  log(metric_type, metric, value);
 }
 
 void statlog_log(const char* metric_type, const char* metric, float value) {
-  log(metric_type, metric, "%f", value);
+  log(metric_type, metric, value);
+}
+
+void statlog_flush() {
+  s.start();
+  s.flush();
 }
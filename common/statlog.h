@@ -2,9 +2,19 @@
 
 #define STATLOG_GAUGE "g"
 #define STATLOG_SAMPLE "sa"
+#define STATLOG_COUNT "c"
+
+// Metrics are aggregated in thread-local storage and sent to statsd as one batch every
+// STATLOG_FLUSH_INTERVAL_MS: gauges keep the last value, counts are summed and samples
+// are reduced to count, sum, min, max and a log-scale histogram.
+#define STATLOG_FLUSH_INTERVAL_MS 1000
 
 void statlog_log(const char* metric_type, const char* metric, int value);
 void statlog_log(const char* metric_type, const char* metric, float value);
 
+// send everything aggregated so far without waiting for the next interval
+void statlog_flush();
+
 #define statlog_gauge(metric, value) statlog_log(STATLOG_GAUGE, metric, value)
 #define statlog_sample(metric, value) statlog_log(STATLOG_SAMPLE, metric, value)
+#define statlog_count(metric, value) statlog_log(STATLOG_COUNT, metric, value)
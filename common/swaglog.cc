@@ -14,18 +14,41 @@
 #include <zmq.h>
 #include "json11.hpp"
 
+#include "common/queue.h"
 #include "common/util.h"
 #include "common/version.h"
 #include "system/hardware/hw.h"
 
+// records up to RECORD_SLOT_SIZE are built in place in the queue, bigger ones are allocated
+const size_t RECORD_SLOT_SIZE = 1024;
+const size_t RECORD_QUEUE_SIZE = 128;
+const size_t MSG_BUF_SIZE = 1024;
+
+struct RecordSlot {
+  uint32_t size;
+  char *heap;  // freed by the sender
+  char data[RECORD_SLOT_SIZE];
+};
+
 class SwaglogState : public LogState {
  public:
   SwaglogState() : LogState("ipc:///tmp/logmessage") {}
 
-  json11::Json::object ctx_j;
+  ~SwaglogState() {
+    if (sender.joinable()) {
+      // wake up the sender, it drains the queue before exiting
+      exit = true;
+      queue->try_push_with([](RecordSlot &slot) { slot.size = 0; slot.heap = nullptr; });
+      sender.join();
+    }
+  }
+
+  std::once_flag init_once;
+  std::string ctx;
+  std::unique_ptr<RingQueue<RecordSlot, RECORD_QUEUE_SIZE, true>> queue;
 
   inline void initialize() {
-    ctx_j = json11::Json::object {};
+    json11::Json::object ctx_j;
     print_level = CLOUDLOG_WARNING;
     const char* print_lvl = getenv("LOGPRINT");
     if (print_lvl) {
@@ -52,72 +75,114 @@ class SwaglogState : public LogState {
 
     // device type
     ctx_j["device"] = Hardware::get_name();
+    ctx = json11::Json(ctx_j).dump();
+
     LogState::initialize();
+    queue = std::make_unique<RingQueue<RecordSlot, RECORD_QUEUE_SIZE, true>>();
+    sender = std::thread(&SwaglogState::senderThread, this);
+  }
+
+ private:
+  // the only user of the zmq socket, logging threads never touch it
+  void senderThread() {
+    auto send = [this](RecordSlot &slot) {
+      if (slot.size > 0) {
+        zmq_send(sock, slot.heap ? slot.heap : slot.data, slot.size, ZMQ_NOBLOCK);
+      }
+      free(slot.heap);
+      slot.heap = nullptr;
+    };
+
+    while (!exit || !queue->empty()) {
+      queue->try_pop_with(send, 100);
+    }
   }
+
+  std::atomic<bool> exit = false;
+  std::thread sender;
 };
 
 static SwaglogState s = {};
 bool LOG_TIMESTAMPS = getenv("LOG_TIMESTAMPS");
 uint32_t NO_FRAME_ID = std::numeric_limits<uint32_t>::max();
 
-static void log(int levelnum, const char* filename, int lineno, const char* func, const char* msg, const std::string& log_s) {
+static void cloudlog_common(int levelnum, const char* filename, int lineno, const char* func,
+                            uint16_t flags, uint32_t frame_id, const char* msg, size_t msg_len) {
+  std::call_once(s.init_once, [] { s.initialize(); });
+
   if (levelnum >= s.print_level) {
     printf("%s: %s\n", filename, msg);
   }
-  char levelnum_c = levelnum;
-  zmq_send(s.sock, (levelnum_c + log_s).c_str(), log_s.length() + 1, ZMQ_NOBLOCK);
-}
 
-static void cloudlog_common(int levelnum, const char* filename, int lineno, const char* func,
-                            char* msg_buf, const json11::Json::object &msg_j={}) {
-  std::lock_guard lk(s.lock);
-  if (!s.initialized) s.initialize();
-
-  json11::Json::object log_j = json11::Json::object {
-    {"ctx", s.ctx_j},
-    {"levelnum", levelnum},
-    {"filename", filename},
-    {"lineno", lineno},
-    {"funcname", func},
-    {"created", seconds_since_epoch()}
+  const size_t filename_len = std::min(strlen(filename), (size_t)UINT16_MAX);
+  const size_t func_len = std::min(strlen(func), (size_t)UINT16_MAX);
+  const SwaglogRecordHeader header = {
+    .levelnum = (uint8_t)levelnum,
+    .binary = 0,
+    .flags = flags,
+    .lineno = lineno,
+    .frame_id = frame_id,
+    .msg_len = (uint32_t)msg_len,
+    .ctx_len = (uint16_t)s.ctx.size(),
+    .filename_len = (uint16_t)filename_len,
+    .funcname_len = (uint16_t)func_len,
+    .reserved = 0,
+    .created = seconds_since_epoch(),
+    .timestamp = (flags & SWAGLOG_TIMESTAMP) ? nanos_since_boot() : 0,
   };
-  if (msg_j.empty()) {
-    log_j["msg"] = msg_buf;
-  } else {
-    log_j["msg"] = msg_j;
+  const size_t size = sizeof(header) + header.ctx_len + filename_len + func_len + msg_len;
+
+  // dropped if logmessaged can't keep up, same as a full zmq queue
+  s.queue->try_push_with([&](RecordSlot &slot) {
+    char *p = slot.data;
+    slot.size = size;
+    slot.heap = nullptr;
+    if (size > sizeof(slot.data) && !(p = slot.heap = (char *)malloc(size))) {
+      slot.size = 0;
+      return;
+    }
+
+    memcpy(p, &header, sizeof(header));
+    p = (char *)memcpy(p + sizeof(header), s.ctx.data(), header.ctx_len) + header.ctx_len;
+    p = (char *)memcpy(p, filename, filename_len) + filename_len;
+    p = (char *)memcpy(p, func, func_len) + func_len;
+    memcpy(p, msg, msg_len);
+  });
+}
+
+static void cloudlog_v(int levelnum, const char* filename, int lineno, const char* func,
+                       uint16_t flags, uint32_t frame_id, const char* fmt, va_list args) {
+  // format into a per-thread buffer, only messages that don't fit are allocated
+  thread_local char msg_buf[MSG_BUF_SIZE];
+  char* msg = msg_buf;
+
+  va_list args_copy;
+  va_copy(args_copy, args);
+  int ret = vsnprintf(msg_buf, sizeof(msg_buf), fmt, args);
+  if (ret > 0 && (size_t)ret >= sizeof(msg_buf)) {
+    msg = nullptr;
+    ret = vasprintf(&msg, fmt, args_copy);
   }
+  va_end(args_copy);
+  if (ret <= 0 || !msg) return;
 
-  std::string log_s = ((json11::Json)log_j).dump();
-  log(levelnum, filename, lineno, func, msg_buf, log_s);
-  free(msg_buf);
+  cloudlog_common(levelnum, filename, lineno, func, flags, frame_id, msg, ret);
+  if (msg != msg_buf) free(msg);
 }
 
 void cloudlog_e(int levelnum, const char* filename, int lineno, const char* func,
                 const char* fmt, ...) {
   va_list args;
   va_start(args, fmt);
-  char* msg_buf = nullptr;
-  int ret = vasprintf(&msg_buf, fmt, args);
+  cloudlog_v(levelnum, filename, lineno, func, 0, NO_FRAME_ID, fmt, args);
   va_end(args);
-  if (ret <= 0 || !msg_buf) return;
-  cloudlog_common(levelnum, filename, lineno, func, msg_buf);
 }
 
 void cloudlog_t_common(int levelnum, const char* filename, int lineno, const char* func,
                        uint32_t frame_id, const char* fmt, va_list args) {
   if (!LOG_TIMESTAMPS) return;
-  char* msg_buf = nullptr;
-  int ret = vasprintf(&msg_buf, fmt, args);
-  if (ret <= 0 || !msg_buf) return;
-  json11::Json::object tspt_j = json11::Json::object{
-    {"event", msg_buf},
-    {"time", std::to_string(nanos_since_boot())}
-  };
-  if (frame_id < NO_FRAME_ID) {
-    tspt_j["frame_id"] = std::to_string(frame_id);
-  }
-  tspt_j = json11::Json::object{{"timestamp", tspt_j}};
-  cloudlog_common(levelnum, filename, lineno, func, msg_buf, tspt_j);
+  uint16_t flags = SWAGLOG_TIMESTAMP | (frame_id < NO_FRAME_ID ? SWAGLOG_FRAME_ID : 0);
+  cloudlog_v(levelnum, filename, lineno, func, flags, frame_id, fmt, args);
 }
 
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 #include "common/timing.h"
 
 #define CLOUDLOG_DEBUG 10
@@ -9,6 +11,28 @@
 #define CLOUDLOG_CRITICAL 50
 
 
+// Records are sent to logmessaged as [SwaglogRecordHeader][ctx][filename][funcname][msg] and turned
+// into JSON there. Python records are [levelnum][json], the zero byte after levelnum tells them apart.
+// Keep in sync with system/logmessaged.py
+#define SWAGLOG_TIMESTAMP 0x1
+#define SWAGLOG_FRAME_ID 0x2
+
+struct SwaglogRecordHeader {
+  uint8_t levelnum;
+  uint8_t binary;  // always 0
+  uint16_t flags;
+  int32_t lineno;
+  uint32_t frame_id;
+  uint32_t msg_len;
+  uint16_t ctx_len;  // pre-serialized json
+  uint16_t filename_len;
+  uint16_t funcname_len;
+  uint16_t reserved;
+  double created;
+  uint64_t timestamp;  // nanos_since_boot of timestamp events
+};
+static_assert(sizeof(SwaglogRecordHeader) == 40);
+
 #ifdef __GNUC__
 #define SWAG_LOG_CHECK_FMT(a, b) __attribute__ ((format (printf, a, b)))
 #else
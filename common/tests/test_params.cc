@@ -0,0 +1,166 @@
+#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+
+#include <cstdio>
+#include <future>
+
+#include "catch2/catch.hpp"
+#include "common/params.h"
+#include "common/timing.h"
+#include "common/util.h"
+
+// wait for the inotify watcher to pick up changes made behind the cache's back
+static bool wait_for_value(Params &params, const std::string &key, const std::string &expected) {
+  for (int i = 0; i < 100; ++i) {
+    if (params.get(key) == expected) return true;
+    util::sleep_for(10);
+  }
+  return false;
+}
+
+TEST_CASE("Params: cached get") {
+  char tmp_path[] = "/tmp/test_params_XXXXXX";
+  const std::string param_path = mkdtemp(tmp_path);
+  Params params(param_path);
+  Params cached_params(param_path, true);
+
+  params.put("DongleId", "cb38263377b873ee");
+  REQUIRE(cached_params.get("DongleId") == "cb38263377b873ee");
+  REQUIRE(cached_params.get("CarParams").empty());
+
+  SECTION("in-process writes are visible immediately") {
+    params.put("DongleId", "bob");
+    REQUIRE(cached_params.get("DongleId") == "bob");
+    params.put("CarParams", "test");
+    REQUIRE(cached_params.get("CarParams") == "test");
+    params.remove("DongleId");
+    REQUIRE(cached_params.get("DongleId").empty());
+    params.clearAll(CLEAR_ON_MANAGER_START);
+    REQUIRE(cached_params.get("CarParams").empty());
+  }
+  SECTION("out-of-process writes invalidate through inotify") {
+    // same sequence as Params::put from another process: write a temp file and rename it into place
+    std::string tmp_file = param_path + "/.tmp_value";
+    REQUIRE(util::write_file(tmp_file.c_str(), "alice", 5, O_WRONLY | O_CREAT) == 0);
+    REQUIRE(rename(tmp_file.c_str(), params.getParamPath("DongleId").c_str()) == 0);
+    REQUIRE(wait_for_value(cached_params, "DongleId", "alice"));
+
+    REQUIRE(unlink(params.getParamPath("DongleId").c_str()) == 0);
+    REQUIRE(wait_for_value(cached_params, "DongleId", ""));
+  }
+  system(("rm -rf " + param_path).c_str());
+}
+
+TEST_CASE("Params: get benchmark", "[.][benchmark]") {
+  char tmp_path[] = "/tmp/test_params_XXXXXX";
+  const std::string param_path = mkdtemp(tmp_path);
+  {
+    Params params(param_path);
+    Params cached_params(param_path, true);
+    params.put("DongleId", "cb38263377b873ee");
+
+    BENCHMARK("get") {
+      return params.get("DongleId");
+    };
+    BENCHMARK("get cached") {
+      return cached_params.get("DongleId");
+    };
+  }
+  system(("rm -rf " + param_path).c_str());
+}
+
+TEST_CASE("Params::Transaction") {
+  char tmp_path[] = "/tmp/test_params_XXXXXX";
+  const std::string param_path = mkdtemp(tmp_path);
+  Params params(param_path);
+  params.put("DongleId", "cb38263377b873ee");
+  params.put("CarParams", "test");
+
+  Params::Transaction tx(params);
+  tx.put("GitBranch", "master");
+  tx.putBool("IsMetric", true);
+  tx.remove("CarParams");
+  tx.remove("CarVin");  // removing a missing key is not an error
+  tx.put("GitCommit", "old");
+  tx.put("GitCommit", "new");
+
+  // nothing is written before commit
+  REQUIRE(params.get("GitBranch").empty());
+  REQUIRE(params.get("CarParams") == "test");
+
+  REQUIRE(tx.commit() == 0);
+  REQUIRE(params.get("GitBranch") == "master");
+  REQUIRE(params.getBool("IsMetric"));
+  REQUIRE(params.get("GitCommit") == "new");
+  REQUIRE(params.get("CarParams").empty());
+  REQUIRE(params.get("DongleId") == "cb38263377b873ee");
+
+  // no temp files are left behind
+  for (auto &[name, _] : util::read_files_in_dir(param_path)) {
+    REQUIRE(name.find(".tmp_value_") == std::string::npos);
+  }
+  system(("rm -rf " + param_path).c_str());
+}
+
+TEST_CASE("Params: transaction benchmark", "[.][benchmark]") {
+  // tmpfs, and a disk-backed directory (ext4 on device and most PCs)
+  const std::string root = GENERATE(std::string("/dev/shm"), util::getenv("PARAMS_BENCH_DISK_DIR", "/var/tmp"));
+  std::string tmp_path = root + "/test_params_XXXXXX";
+  const std::string param_path = mkdtemp(tmp_path.data());
+  {
+    Params params(param_path);
+    const std::vector<std::string> keys = {"GitBranch", "GitCommit", "GitRemote", "Version", "TermsVersion",
+                                           "TrainingVersion", "IsTestedBranch", "IsReleaseBranch"};
+
+    BENCHMARK(util::string_format("put x%d in %s", (int)keys.size(), root.c_str())) {
+      for (auto &k : keys) params.put(k, "1");
+    };
+    BENCHMARK(util::string_format("transaction x%d in %s", (int)keys.size(), root.c_str())) {
+      Params::Transaction tx(params);
+      for (auto &k : keys) tx.put(k, "1");
+      return tx.commit();
+    };
+  }
+  system(("rm -rf " + param_path).c_str());
+}
+
+TEST_CASE("Params::putNonBlocking") {
+  char tmp_path[] = "/tmp/test_params_XXXXXX";
+  const std::string param_path = mkdtemp(tmp_path);
+  Params params(param_path);
+
+  for (int i = 0; i < 100; ++i) {
+    REQUIRE(params.putNonBlocking("LastGPSPosition", std::to_string(i)));
+  }
+  REQUIRE(params.putBoolNonBlocking("IsMetric", true));
+  Params::flushNonBlocking();
+
+  // writes to the same key are coalesced, the last one wins
+  REQUIRE(params.get("LastGPSPosition") == "99");
+  REQUIRE(params.getBool("IsMetric"));
+  system(("rm -rf " + param_path).c_str());
+}
+
+TEST_CASE("Params: blocking get") {
+  char tmp_path[] = "/tmp/test_params_XXXXXX";
+  const std::string param_path = mkdtemp(tmp_path);
+  Params params(param_path);
+
+  SECTION("wakes up as soon as the value is written") {
+    auto writer = std::async(std::launch::async, [&]() {
+      util::sleep_for(50);
+      Params(param_path).put("CarParams", "test");
+      return millis_since_boot();
+    });
+    REQUIRE(params.get("CarParams", true, 2000) == "test");
+    double woke_up = millis_since_boot();
+    // woken up by the write, long before the timeout
+    REQUIRE(woke_up - writer.get() < 500);
+  }
+  SECTION("times out") {
+    double start = millis_since_boot();
+    REQUIRE(params.get("CarParams", true, 100).empty());
+    REQUIRE(millis_since_boot() - start >= 100);
+  }
+  system(("rm -rf " + param_path).c_str());
+}
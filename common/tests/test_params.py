@@ -47,6 +47,17 @@ class TestParams(unittest.TestCase):
     assert self.params.get("DongleId") == b"bob"
     assert self.params.get("AthenadPid") == b"123"
 
+  def test_params_put_many(self):
+    self.params.put("CarParams", "test")
+    self.params.put_many({"DongleId": "bob", "IsMetric": True, "AthenadPid": b"123"}, removes=["CarParams"])
+    assert self.params.get("DongleId") == b"bob"
+    assert self.params.get_bool("IsMetric")
+    assert self.params.get("AthenadPid") == b"123"
+    assert self.params.get("CarParams") is None
+
+    with self.assertRaises(UnknownKeyName):
+      self.params.put_many({"swag": "abc"})
+
   def test_params_get_block(self):
     def _delayed_writer():
       time.sleep(0.1)
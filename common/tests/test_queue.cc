@@ -0,0 +1,105 @@
+#define CATCH_CONFIG_MAIN
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "common/queue.h"
+#include "common/timing.h"
+
+TEST_CASE("RingQueue: single thread") {
+  RingQueue<int, 4> q;
+  int v = 0;
+  REQUIRE(q.empty());
+  REQUIRE(!q.try_pop(v));
+
+  for (int i = 0; i < 4; ++i) {
+    REQUIRE(q.try_push(i));
+  }
+  REQUIRE(q.size() == 4);
+  REQUIRE(!q.try_push(4));
+
+  for (int i = 0; i < 4; ++i) {
+    REQUIRE(q.try_pop(v));
+    REQUIRE(v == i);
+  }
+  REQUIRE(q.empty());
+
+  SECTION("timed pop") {
+    double start = millis_since_boot();
+    REQUIRE(!q.try_pop(v, 50));
+    REQUIRE(millis_since_boot() - start >= 50);
+  }
+}
+
+template <class Q>
+static void test_producers(Q &q, int producer_cnt, int msg_cnt) {
+  std::vector<std::thread> producers;
+  for (int p = 0; p < producer_cnt; ++p) {
+    producers.emplace_back([&q, p, msg_cnt]() {
+      for (int i = 0; i < msg_cnt; ++i) q.push(p * msg_cnt + i);
+    });
+  }
+
+  // every message arrives once, in order per producer
+  std::vector<int> last(producer_cnt, -1);
+  for (int i = 0; i < producer_cnt * msg_cnt; ++i) {
+    int v = q.pop();
+    int p = v / msg_cnt;
+    REQUIRE(v % msg_cnt == last[p] + 1);
+    last[p] = v % msg_cnt;
+  }
+  for (auto &t : producers) t.join();
+  REQUIRE(q.empty());
+}
+
+TEST_CASE("RingQueue: SPSC") {
+  RingQueue<int, 8> q;
+  test_producers(q, 1, 100000);
+}
+
+TEST_CASE("RingQueue: MPSC") {
+  RingQueue<int, 8, true> q;
+  test_producers(q, 4, 50000);
+}
+
+// push timestamps from producer_cnt threads, report throughput and pop latency percentiles
+template <class Q>
+static void bench_queue(const char *name, Q &q, int producer_cnt) {
+  const int msg_cnt = 200000;
+  std::vector<double> latency;
+  latency.reserve(producer_cnt * msg_cnt);
+
+  double start = millis_since_boot();
+  std::vector<std::thread> producers;
+  for (int p = 0; p < producer_cnt; ++p) {
+    producers.emplace_back([&q]() {
+      for (int i = 0; i < msg_cnt; ++i) q.push(nanos_since_boot());
+    });
+  }
+  for (int i = 0; i < producer_cnt * msg_cnt; ++i) {
+    uint64_t ts = q.pop();
+    latency.push_back((nanos_since_boot() - ts) / 1000.0);
+  }
+  double elapsed = millis_since_boot() - start;
+  for (auto &t : producers) t.join();
+
+  std::sort(latency.begin(), latency.end());
+  auto percentile = [&](double p) { return latency[std::min(latency.size() - 1, (size_t)(latency.size() * p))]; };
+  printf("%-28s producers: %d  %8.2f Mmsg/s  p50: %7.2fus  p99: %7.2fus  p99.9: %8.2fus\n", name, producer_cnt,
+         latency.size() / elapsed / 1000.0, percentile(0.5), percentile(0.99), percentile(0.999));
+}
+
+TEST_CASE("RingQueue: benchmark against SafeQueue", "[.][benchmark]") {
+  for (int producer_cnt : {1, 2, 4}) {
+    SafeQueue<uint64_t> safe_queue;
+    bench_queue("SafeQueue", safe_queue, producer_cnt);
+    if (producer_cnt == 1) {
+      RingQueue<uint64_t, 1024> spsc;
+      bench_queue("RingQueue<SPSC>", spsc, producer_cnt);
+    }
+    RingQueue<uint64_t, 1024, true> mpsc;
+    bench_queue("RingQueue<MPSC>", mpsc, producer_cnt);
+  }
+}
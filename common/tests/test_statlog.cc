@@ -0,0 +1,104 @@
+#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+
+#include <zmq.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "common/statlog.h"
+#include "common/util.h"
+
+const char *STATS_ADDR = "ipc:///tmp/stats";
+
+// everything received, the periodic flush may split the metrics over several messages
+struct Totals {
+  std::string gauge;
+  double bytes = 0;
+  uint32_t count = 0, histogram_count = 0;
+  double sum = 0, min = 1e9, max = -1e9;
+};
+
+static bool recv_batch(void *sock, Totals &totals) {
+  char buf[65536] = {};
+  int n = zmq_recv(sock, buf, sizeof(buf) - 1, 0);
+  if (n <= 0) return false;
+
+  std::istringstream lines(std::string(buf, n));
+  for (std::string line; std::getline(lines, line);) {
+    auto pos = line.find(':');
+    const std::string name = line.substr(0, pos), value = line.substr(pos + 1);
+    if (name == "test_gauge") {
+      totals.gauge = value;
+    } else if (name == "test_bytes") {
+      totals.bytes += std::stod(value);
+    } else if (name == "test_latency") {
+      uint32_t count = 0;
+      double sum = 0, min = 0, max = 0;
+      REQUIRE(sscanf(value.c_str(), "%u,%lf,%lf,%lf|ag|", &count, &sum, &min, &max) == 4);
+      totals.count += count;
+      totals.sum += sum;
+      totals.min = std::min(totals.min, min);
+      totals.max = std::max(totals.max, max);
+      std::istringstream buckets(value.substr(value.rfind('|') + 1));
+      for (std::string bucket; std::getline(buckets, bucket, ',');) {
+        totals.histogram_count += std::stoi(bucket.substr(bucket.find(':') + 1));
+      }
+    }
+  }
+  return true;
+}
+
+TEST_CASE("statlog") {
+  void *zctx = zmq_ctx_new();
+  void *sock = zmq_socket(zctx, ZMQ_PULL);
+  const int timeout_ms = 2 * STATLOG_FLUSH_INTERVAL_MS;
+  zmq_setsockopt(sock, ZMQ_RCVTIMEO, &timeout_ms, sizeof(timeout_ms));
+  zmq_bind(sock, STATS_ADDR);
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([i]() {
+      for (int j = 1; j <= 100; ++j) {
+        statlog_count("test_bytes", 10);
+        statlog_sample("test_latency", (float)j);
+      }
+      // dropped
+      statlog_sample("test_latency", NAN);
+      statlog_sample("test_latency", INFINITY);
+      statlog_gauge("test_gauge", i);
+    });
+  }
+  for (auto &t : threads) t.join();
+  statlog_gauge("test_gauge", 42);
+  statlog_flush();
+
+  // all threads are merged, usually into one message
+  Totals totals;
+  while (totals.count < 400 || totals.bytes < 4000 || totals.gauge != "42.000000|g") {
+    REQUIRE(recv_batch(sock, totals));
+  }
+  REQUIRE(totals.bytes == 4000);
+  REQUIRE(totals.count == 400);
+  REQUIRE(totals.sum == 20200);
+  REQUIRE(totals.min == 1);
+  REQUIRE(totals.max == 100);
+  REQUIRE(totals.histogram_count == 400);
+
+  zmq_close(sock);
+  zmq_ctx_destroy(zctx);
+}
+
+TEST_CASE("statlog: benchmark", "[.][benchmark]") {
+  BENCHMARK("statlog_sample") {
+    statlog_sample("benchmark_sample", 1.5f);
+  };
+  BENCHMARK("statlog_count") {
+    statlog_count("benchmark_count", 1);
+  };
+}
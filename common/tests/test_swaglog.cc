@@ -1,4 +1,5 @@
 #include <zmq.h>
+#include <cstring>
 #include <iostream>
 #define CATCH_CONFIG_MAIN
 #include "catch2/catch.hpp"
@@ -38,17 +39,23 @@ void recv_log(int thread_cnt, int thread_msg_cnt) {
       break;
     }
 
-    REQUIRE(buf[0] == CLOUDLOG_DEBUG);
-    std::string err;
-    auto msg = json11::Json::parse(buf + 1, err);
-    REQUIRE(!msg.is_null());
-
-    REQUIRE(msg["levelnum"].int_value() == CLOUDLOG_DEBUG);
-    REQUIRE_THAT(msg["filename"].string_value(), Catch::Contains("test_swaglog.cc"));
-    REQUIRE(msg["funcname"].string_value() == "log_thread");
-    REQUIRE(msg["lineno"].int_value() == LINE_NO);
+    SwaglogRecordHeader header;
+    memcpy(&header, buf, sizeof(header));
+    REQUIRE(header.levelnum == CLOUDLOG_DEBUG);
+    REQUIRE(header.binary == 0);
+    REQUIRE(header.flags == 0);
+    REQUIRE(header.lineno == LINE_NO);
 
-    auto ctx = msg["ctx"];
+    const char *p = buf + sizeof(header);
+    std::string err;
+    auto ctx = json11::Json::parse(std::string(p, header.ctx_len), err);
+    REQUIRE(!ctx.is_null());
+    p += header.ctx_len;
+    REQUIRE_THAT(std::string(p, header.filename_len), Catch::Contains("test_swaglog.cc"));
+    p += header.filename_len;
+    REQUIRE(std::string(p, header.funcname_len) == "log_thread");
+    p += header.funcname_len;
+    std::string msg(p, header.msg_len);
 
     REQUIRE(ctx["daemon"].string_value() == daemon_name);
     REQUIRE(ctx["dongle_id"].string_value() == dongle_id);
@@ -59,7 +66,7 @@ void recv_log(int thread_cnt, int thread_msg_cnt) {
     std::string device = Hardware::get_name();
     REQUIRE(ctx["device"].string_value() == device);
 
-    int thread_id = atoi(msg["msg"].string_value().c_str());
+    int thread_id = atoi(msg.c_str());
     REQUIRE((thread_id >= 0 && thread_id < thread_cnt));
     thread_msgs[thread_id]++;
     total_count++;
@@ -87,3 +94,20 @@ TEST_CASE("swaglog") {
 
   recv_log(thread_cnt, thread_msg_cnt);
 }
+
+TEST_CASE("swaglog: benchmark", "[.][benchmark]") {
+  const int msg_cnt = 100000;
+  for (int thread_cnt : {1, 2, 4, 8}) {
+    double start = millis_since_boot();
+    std::vector<std::thread> log_threads;
+    for (int i = 0; i < thread_cnt; ++i) {
+      log_threads.push_back(std::thread([=]() {
+        for (int j = 0; j < msg_cnt; ++j) LOGD("benchmark %d %d", i, j);
+      }));
+    }
+    for (auto &t : log_threads) t.join();
+    double elapsed = millis_since_boot() - start;
+    printf("threads: %d  %.2f M LOG calls/s  %.1f ns/call\n", thread_cnt,
+           thread_cnt * msg_cnt / elapsed / 1000.0, elapsed * 1e6 / (thread_cnt * msg_cnt));
+  }
+}
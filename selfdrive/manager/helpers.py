@@ -39,5 +39,4 @@ def unblock_stdout() -> None:
 
 
 def write_onroad_params(started, params):
-  params.put_bool("IsOnroad", started)
-  params.put_bool("IsOffroad", not started)
+  params.put_many({"IsOnroad": started, "IsOffroad": not started})
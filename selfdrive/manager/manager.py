@@ -54,9 +54,7 @@ def manager_init() -> None:
     params.put_bool("RecordFront", True)
 
   # set unset params
-  for k, v in default_params:
-    if params.get(k) is None:
-      params.put(k, v)
+  params.put_many({k: v for k, v in default_params if params.get(k) is None})
 
   # is this dashcam?
   if os.getenv("PASSIVE") is not None:
@@ -74,14 +72,16 @@ def manager_init() -> None:
     print("WARNING: failed to make /dev/shm")
 
   # set version params
-  params.put("Version", get_version())
-  params.put("TermsVersion", terms_version)
-  params.put("TrainingVersion", training_version)
-  params.put("GitCommit", get_commit(default=""))
-  params.put("GitBranch", get_short_branch(default=""))
-  params.put("GitRemote", get_origin(default=""))
-  params.put_bool("IsTestedBranch", is_tested_branch())
-  params.put_bool("IsReleaseBranch", is_release_branch())
+  params.put_many({
+    "Version": get_version(),
+    "TermsVersion": terms_version,
+    "TrainingVersion": training_version,
+    "GitCommit": get_commit(default=""),
+    "GitBranch": get_short_branch(default=""),
+    "GitRemote": get_origin(default=""),
+    "IsTestedBranch": is_tested_branch(),
+    "IsReleaseBranch": is_release_branch(),
+  })
 
   # set dongle id
   reg_res = register(show_spinner=True)
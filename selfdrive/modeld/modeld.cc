@@ -62,7 +62,8 @@ void run_model(ModelState &model, VisionIpcClient &vipc_client_main, VisionIpcCl
   PubMaster pm({"modelV2", "cameraOdometry"});
   SubMaster sm({"lateralPlan", "roadCameraState", "liveCalibration", "driverMonitoringState", "navModel", "navInstruction"});
 
-  Params params;
+  // ExperimentalMode is read every frame
+  Params params({}, true);
   PublishState ps = {};
 
   // setup filter to track dropped frames
@@ -3,9 +3,9 @@ import os
 import zmq
 import time
 from pathlib import Path
-from collections import defaultdict
+from collections import Counter, defaultdict
 from datetime import datetime, timezone
-from typing import NoReturn, Union, List, Dict
+from typing import NoReturn, Union, Dict
 
 from common.params import Params
 from cereal.messaging import SubMaster
@@ -19,6 +19,34 @@ from system.loggerd.config import STATS_DIR, STATS_DIR_FILE_LIMIT, STATS_SOCKET,
 class METRIC_TYPE:
   GAUGE = 'g'
   SAMPLE = 'sa'
+  COUNT = 'c'
+  AGGREGATED_SAMPLES = 'ag'  # pre-aggregated by common/statlog.cc
+
+class SampleStats:
+  def __init__(self):
+    self.count = 0
+    self.sum = 0.
+    self.min = float('inf')
+    self.max = float('-inf')
+    self.histogram: Counter = Counter()  # value or bucket -> count
+
+  def add(self, value: float) -> None:
+    self.merge(1, value, value, value, {value: 1})
+
+  def merge(self, count: int, total: float, vmin: float, vmax: float, histogram: Dict[float, int]) -> None:
+    self.count += count
+    self.sum += total
+    self.min = min(self.min, vmin)
+    self.max = max(self.max, vmax)
+    self.histogram.update(histogram)
+
+  def percentile(self, percentile: float) -> float:
+    idx = int(round(percentile * (self.count - 1)))
+    for value, count in sorted(self.histogram.items()):
+      idx -= count
+      if idx < 0:
+        return min(max(value, self.min), self.max)
+    return self.max
 
 class StatLog:
   def __init__(self):
@@ -99,7 +127,8 @@ def main() -> NoReturn:
   idx = 0
   last_flush_time = time.monotonic()
   gauges = {}
-  samples: Dict[str, List[float]] = defaultdict(list)
+  counts: Dict[str, float] = defaultdict(float)
+  samples: Dict[str, SampleStats] = defaultdict(SampleStats)
   try:
     while True:
       started_prev = sm['deviceState'].started
@@ -108,22 +137,31 @@ def main() -> NoReturn:
       # Update metrics
       while True:
         try:
-          metric = sock.recv_string(zmq.NOBLOCK)
+          batch = sock.recv_string(zmq.NOBLOCK)
+        except zmq.error.Again:
+          break
+
+        # C++ processes send all metrics of a flush interval as one message, one per line
+        for metric in batch.split('\n'):
           try:
             metric_type = metric.split('|')[1]
             metric_name = metric.split(':')[0]
-            metric_value = float(metric.split('|')[0].split(':')[1])
+            metric_value = metric.split('|')[0].split(':')[1]
 
             if metric_type == METRIC_TYPE.GAUGE:
-              gauges[metric_name] = metric_value
+              gauges[metric_name] = float(metric_value)
             elif metric_type == METRIC_TYPE.SAMPLE:
-              samples[metric_name].append(metric_value)
+              samples[metric_name].add(float(metric_value))
+            elif metric_type == METRIC_TYPE.COUNT:
+              counts[metric_name] += float(metric_value)
+            elif metric_type == METRIC_TYPE.AGGREGATED_SAMPLES:
+              count, total, vmin, vmax = metric_value.split(',')
+              histogram = {float(b): int(c) for b, c in (bucket.split(':') for bucket in metric.split('|')[2].split(','))}
+              samples[metric_name].merge(int(count), float(total), float(vmin), float(vmax), histogram)
             else:
               cloudlog.event("unknown metric type", metric_type=metric_type)
           except Exception:
             cloudlog.event("malformed metric", metric=metric)
-        except zmq.error.Again:
-          break
 
       # flush when started state changes or after FLUSH_TIME_S
       if (time.monotonic() > last_flush_time + STATS_FLUSH_TIME_S) or (sm['deviceState'].started != started_prev):
@@ -134,25 +172,24 @@ def main() -> NoReturn:
         for key, value in gauges.items():
           result += get_influxdb_line(f"gauge.{key}", value, current_time, tags)
 
-        for key, values in samples.items():
-          values.sort()
-          sample_count = len(values)
-          sample_sum = sum(values)
+        for key, value in counts.items():
+          result += get_influxdb_line(f"count.{key}", value, current_time, tags)
 
+        for key, sample in samples.items():
           stats = {
-            'count': sample_count,
-            'min': values[0],
-            'max': values[-1],
-            'mean': sample_sum / sample_count,
+            'count': sample.count,
+            'min': sample.min,
+            'max': sample.max,
+            'mean': sample.sum / sample.count,
           }
           for percentile in [0.05, 0.5, 0.95]:
-            value = values[int(round(percentile * (sample_count - 1)))]
-            stats[f"p{int(percentile * 100)}"] = value
+            stats[f"p{int(percentile * 100)}"] = sample.percentile(percentile)
 
           result += get_influxdb_line(f"sample.{key}", stats, current_time, tags)
 
         # clear intermediate data
         gauges.clear()
+        counts.clear()
         samples.clear()
         last_flush_time = time.monotonic()
 
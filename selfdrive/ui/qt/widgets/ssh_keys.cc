@@ -40,8 +40,10 @@ void SshControl::getUserKeys(const QString &username) {
   QObject::connect(request, &HttpRequest::requestDone, [=](const QString &resp, bool success) {
     if (success) {
       if (!resp.isEmpty()) {
-        params.put("GithubUsername", username.toStdString());
-        params.put("GithubSshKeys", resp.toStdString());
+        Params::Transaction tx(params);
+        tx.put("GithubUsername", username.toStdString());
+        tx.put("GithubSshKeys", resp.toStdString());
+        tx.commit();
       } else {
         ConfirmationDialog::alert(tr("Username '%1' has no keys on GitHub").arg(username), this);
       }
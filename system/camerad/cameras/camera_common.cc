@@ -140,7 +140,10 @@ bool CameraBuf::acquire() {
 }
 
 void CameraBuf::queue(size_t buf_idx) {
-  safe_queue.push(buf_idx);
+  // never block the sensor thread, the processing thread is far behind anyway if this fails
+  if (!safe_queue.try_push(buf_idx)) {
+    LOGE("frame queue full, dropping buffer %zu", buf_idx);
+  }
 }
 
 // common functions
@@ -78,7 +78,7 @@ private:
   Debayer *debayer = nullptr;
   VisionStreamType yuv_type;
   int cur_buf_idx;
-  SafeQueue<int> safe_queue;
+  RingQueue<int, 16> safe_queue;
   int frame_buf_count;
 
 public:
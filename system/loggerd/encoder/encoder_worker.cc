@@ -0,0 +1,98 @@
+#include "system/loggerd/encoder/encoder_worker.h"
+
+#include <algorithm>
+
+#include "common/statlog.h"
+#include "common/swaglog.h"
+#include "common/timing.h"
+#include "common/util.h"
+
+// class EncoderFramePool
+
+EncoderFrame *EncoderFramePool::get(int refcnt) {
+  for (auto &frame : frames) {
+    int expected = 0;
+    if (frame.refcnt.compare_exchange_strong(expected, refcnt)) {
+      return &frame;
+    }
+  }
+  return nullptr;
+}
+
+// class EncoderWorker
+
+EncoderWorker::EncoderWorker(std::unique_ptr<VideoEncoder> e, const std::string &name)
+    : name(name), latency_metric("encoderd_" + name + "_latency_ms"), drop_metric("encoderd_" + name + "_dropped"),
+      encoder(std::move(e)) {
+  encoder->encoder_open(NULL);
+  thread = std::thread(&EncoderWorker::run, this);
+}
+
+EncoderWorker::~EncoderWorker() {
+  exit = true;
+  thread.join();
+
+  EncoderFrame *frame = nullptr;
+  while (queue.try_pop(frame)) {
+    --frame->refcnt;
+  }
+  encoder->encoder_close();
+}
+
+bool EncoderWorker::push(EncoderFrame *frame) {
+  if (queue.try_push(frame)) return true;
+
+  --frame->refcnt;
+  statlog_count(drop_metric.c_str(), 1);
+  std::lock_guard lk(stats_lock);
+  if (stats_.dropped++ == 0) {
+    LOGE("encoder %s is behind, dropping frame %d", name.c_str(), frame->extra.frame_id);
+  }
+  return false;
+}
+
+EncoderWorker::Stats EncoderWorker::stats() const {
+  std::lock_guard lk(stats_lock);
+  return stats_;
+}
+
+void EncoderWorker::run() {
+  util::set_thread_name(name.c_str());
+
+  int cur_segment = 0;
+  EncoderFrame *frame = nullptr;
+  while (!exit) {
+    if (!queue.try_pop(frame, 100)) continue;
+
+    // do rotation if required
+    for (; cur_segment < frame->segment; ++cur_segment) {
+      encoder->encoder_close();
+      encoder->encoder_open(NULL);
+    }
+
+    bool encoded = false;
+    if (frame->buf->get_frame_id() == frame->extra.frame_id) {
+      int out_id = encoder->encode_frame(frame->buf, &frame->extra);
+      if (out_id == -1) {
+        LOGE("Failed to encode frame. frame_id: %d", frame->extra.frame_id);
+      }
+      encoded = true;
+    }
+    const double latency_ms = millis_since_boot() - frame->recv_tms;
+    --frame->refcnt;
+
+    if (encoded) {
+      statlog_sample(latency_metric.c_str(), (float)latency_ms);
+    } else {
+      statlog_count(drop_metric.c_str(), 1);
+    }
+    std::lock_guard lk(stats_lock);
+    if (encoded) {
+      ++stats_.encoded;
+      stats_.total_latency_ms += latency_ms;
+      stats_.max_latency_ms = std::max(stats_.max_latency_ms, latency_ms);
+    } else {
+      ++stats_.overwritten;
+    }
+  }
+}
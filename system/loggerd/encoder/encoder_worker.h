@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "cereal/visionipc/visionbuf.h"
+#include "cereal/visionipc/visionipc.h"
+#include "common/queue.h"
+#include "system/loggerd/encoder/encoder.h"
+
+#define ENCODER_QUEUE_SIZE 4
+#define ENCODER_FRAME_POOL_SIZE 8
+
+// a frame received from VisionIpc, shared by all encoders of a camera.
+// the buffer is camerad's, so workers check it wasn't reused before encoding.
+struct EncoderFrame {
+  VisionBuf *buf = nullptr;
+  VisionIpcBufExtra extra = {};
+  int segment = 0;
+  double recv_tms = 0;
+  std::atomic<int> refcnt = 0;
+};
+
+class EncoderFramePool {
+public:
+  // a free frame referenced by refcnt workers, nullptr if all are in use
+  EncoderFrame *get(int refcnt);
+
+private:
+  EncoderFrame frames[ENCODER_FRAME_POOL_SIZE];
+};
+
+// runs one VideoEncoder on its own thread, so a slow encoder only drops its own frames
+class EncoderWorker {
+public:
+  EncoderWorker(std::unique_ptr<VideoEncoder> encoder, const std::string &name);
+  ~EncoderWorker();
+  // hands over one reference of the frame, false if it was dropped
+  bool push(EncoderFrame *frame);
+
+  struct Stats {
+    uint64_t encoded = 0;
+    uint64_t dropped = 0;      // the worker was ENCODER_QUEUE_SIZE frames behind
+    uint64_t overwritten = 0;  // camerad reused the buffer before it was encoded
+    double total_latency_ms = 0;
+    double max_latency_ms = 0;
+  };
+  Stats stats() const;
+
+private:
+  void run();
+
+  const std::string name;
+  const std::string latency_metric, drop_metric;
+  std::unique_ptr<VideoEncoder> encoder;
+  RingQueue<EncoderFrame *, ENCODER_QUEUE_SIZE> queue;
+  std::atomic<bool> exit = false;
+  std::thread thread;
+
+  mutable std::mutex stats_lock;
+  Stats stats_;
+};
@@ -22,6 +22,27 @@ extern "C" {
 #include "common/swaglog.h"
 #include "common/util.h"
 
+void nv12_to_i420_scaled(const VisionBuf *buf, uint8_t *dst, int width, int height, uint8_t *uv_scratch) {
+  uint8_t *out_y = dst;
+  uint8_t *out_u = out_y + width * height;
+  uint8_t *out_v = out_u + (width / 2) * (height / 2);
+  libyuv::ScalePlane(buf->y, buf->stride,
+                     buf->width, buf->height,
+                     out_y, width,
+                     width, height,
+                     libyuv::kFilterNone);
+  // point sampling each UV pair as one 16 bit pixel picks the same samples as scaling U and V separately
+  libyuv::ScalePlane_16((const uint16_t *)buf->uv, buf->stride / 2,
+                        buf->width / 2, buf->height / 2,
+                        (uint16_t *)uv_scratch, width / 2,
+                        width / 2, height / 2,
+                        libyuv::kFilterNone);
+  libyuv::SplitUVPlane(uv_scratch, width,
+                       out_u, width/2,
+                       out_v, width/2,
+                       width/2, height/2);
+}
+
 const int env_debug_encoder = (getenv("DEBUG_ENCODER") != NULL) ? atoi(getenv("DEBUG_ENCODER")) : 0;
 
 FfmpegEncoder::FfmpegEncoder(const EncoderInfo &encoder_info, int in_width, int in_height)
@@ -35,10 +56,11 @@ FfmpegEncoder::FfmpegEncoder(const EncoderInfo &encoder_info, int in_width, int
   frame->linesize[1] = encoder_info.frame_width/2;
   frame->linesize[2] = encoder_info.frame_width/2;
 
-  convert_buf.resize(in_width * in_height * 3 / 2);
-
   if (in_width != encoder_info.frame_width || in_height != encoder_info.frame_height) {
     downscale_buf.resize(encoder_info.frame_width * encoder_info.frame_height * 3 / 2);
+    downscale_uv_buf.resize(encoder_info.frame_width * encoder_info.frame_height / 2);
+  } else {
+    convert_buf.resize(in_width * in_height * 3 / 2);
   }
 }
 
@@ -75,33 +97,22 @@ int FfmpegEncoder::encode_frame(VisionBuf* buf, VisionIpcBufExtra *extra) {
   assert(buf->width == this->in_width);
   assert(buf->height == this->in_height);
 
-  uint8_t *cy = convert_buf.data();
-  uint8_t *cu = cy + in_width * in_height;
-  uint8_t *cv = cu + (in_width / 2) * (in_height / 2);
-  libyuv::NV12ToI420(buf->y, buf->stride,
-                     buf->uv, buf->stride,
-                     cy, in_width,
-                     cu, in_width/2,
-                     cv, in_width/2,
-                     in_width, in_height);
-
   if (downscale_buf.size() > 0) {
     uint8_t *out_y = downscale_buf.data();
-    uint8_t *out_u = out_y + frame->width * frame->height;
-    uint8_t *out_v = out_u + (frame->width / 2) * (frame->height / 2);
-    libyuv::I420Scale(cy, in_width,
-                      cu, in_width/2,
-                      cv, in_width/2,
-                      in_width, in_height,
-                      out_y, frame->width,
-                      out_u, frame->width/2,
-                      out_v, frame->width/2,
-                      frame->width, frame->height,
-                      libyuv::kFilterNone);
+    nv12_to_i420_scaled(buf, out_y, frame->width, frame->height, downscale_uv_buf.data());
     frame->data[0] = out_y;
-    frame->data[1] = out_u;
-    frame->data[2] = out_v;
+    frame->data[1] = out_y + frame->width * frame->height;
+    frame->data[2] = frame->data[1] + (frame->width / 2) * (frame->height / 2);
   } else {
+    uint8_t *cy = convert_buf.data();
+    uint8_t *cu = cy + in_width * in_height;
+    uint8_t *cv = cu + (in_width / 2) * (in_height / 2);
+    libyuv::NV12ToI420(buf->y, buf->stride,
+                       buf->uv, buf->stride,
+                       cy, in_width,
+                       cu, in_width/2,
+                       cv, in_width/2,
+                       in_width, in_height);
     frame->data[0] = cy;
     frame->data[1] = cu;
     frame->data[2] = cv;
@@ -14,6 +14,11 @@ extern "C" {
 #include "system/loggerd/encoder/encoder.h"
 #include "system/loggerd/loggerd.h"
 
+// converts NV12 to I420 and does the nearest-neighbor downscale in the same pass, reading only the
+// sampled source pixels. bit-exact with NV12ToI420 followed by I420Scale(kFilterNone).
+// dst is a contiguous I420 image, uv_scratch holds the scaled UV plane (width * height / 2 bytes).
+void nv12_to_i420_scaled(const VisionBuf *buf, uint8_t *dst, int width, int height, uint8_t *uv_scratch);
+
 class FfmpegEncoder : public VideoEncoder {
 public:
   FfmpegEncoder(const EncoderInfo &encoder_info, int in_width, int in_height);
@@ -31,4 +36,5 @@ private:
   AVFrame *frame = NULL;
   std::vector<uint8_t> convert_buf;
   std::vector<uint8_t> downscale_buf;
+  std::vector<uint8_t> downscale_uv_buf;
 };
@@ -1,5 +1,7 @@
 #include <cassert>
 
+#include "common/statlog.h"
+#include "system/loggerd/encoder/encoder_worker.h"
 #include "system/loggerd/loggerd.h"
 
 #ifdef QCOM2
@@ -47,7 +49,10 @@ bool sync_encoders(EncoderdState *s, CameraType cam_type, uint32_t frame_id) {
 void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
   util::set_thread_name(cam_info.thread_name);
 
-  std::vector<Encoder *> encoders;
+  // every encoder runs on its own worker, sharing the received frames
+  std::vector<std::unique_ptr<EncoderWorker>> workers;
+  EncoderFramePool frame_pool;
+  const std::string drop_metric = std::string("encoderd_") + cam_info.thread_name + "_dropped";
   VisionIpcClient vipc_client = VisionIpcClient("camerad", cam_info.stream_type, false);
 
   int cur_seg = 0;
@@ -58,20 +63,17 @@ void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
     }
 
     // init encoders
-    if (encoders.empty()) {
+    if (workers.empty()) {
       VisionBuf buf_info = vipc_client.buffers[0];
       LOGW("encoder %s init %zux%zu", cam_info.thread_name, buf_info.width, buf_info.height);
       assert(buf_info.width > 0 && buf_info.height > 0);
 
       for (const auto &encoder_info : cam_info.encoder_infos) {
-        encoders.push_back(new Encoder(encoder_info, buf_info.width, buf_info.height));
+        auto encoder = std::make_unique<Encoder>(encoder_info, buf_info.width, buf_info.height);
+        workers.push_back(std::make_unique<EncoderWorker>(std::move(encoder), encoder_info.publish_name));
       }
     }
 
-    for (int i = 0; i < encoders.size(); ++i) {
-      encoders[i]->encoder_open(NULL);
-    }
-
     bool lagging = false;
     while (!do_exit) {
       VisionIpcBufExtra extra;
@@ -93,32 +95,31 @@ void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
       }
       if (do_exit) break;
 
-      // do rotation if required
+      // do rotation if required, the workers rotate on their first frame of the new segment
       const int frames_per_seg = SEGMENT_LENGTH * MAIN_FPS;
       if (cur_seg >= 0 && extra.frame_id >= ((cur_seg + 1) * frames_per_seg) + s->start_frame_id) {
-        for (auto &e : encoders) {
-          e->encoder_close();
-          e->encoder_open(NULL);
-        }
         ++cur_seg;
       }
 
-      // encode a frame
-      for (int i = 0; i < encoders.size(); ++i) {
-        int out_id = encoders[i]->encode_frame(buf, &extra);
-
-        if (out_id == -1) {
-          LOGE("Failed to encode frame. frame_id: %d", extra.frame_id);
-        }
+      // hand the frame to every encoder
+      EncoderFrame *frame = frame_pool.get(workers.size());
+      if (!frame) {
+        LOGE("encoder %s: all frames in use, dropping frame %d", cam_info.thread_name, extra.frame_id);
+        statlog_count(drop_metric.c_str(), 1);
+        continue;
+      }
+      frame->buf = buf;
+      frame->extra = extra;
+      frame->segment = cur_seg;
+      frame->recv_tms = millis_since_boot();
+      for (auto &w : workers) {
+        w->push(frame);
       }
     }
   }
 
   LOG("encoder destroy");
-  for (auto &e : encoders) {
-    e->encoder_close();
-    delete e;
-  }
+  workers.clear();
 }
 
 template <size_t N>
@@ -1,6 +1,8 @@
 #include "system/loggerd/logger.h"
 
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 #include <ftw.h>
 
@@ -10,17 +12,310 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <chrono>
+#include <cmath>
 #include <ctime>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <sstream>
 #include <streambuf>
+#include <vector>
+
+#include <bzlib.h>
+#include <zstd.h>
 
 #include "common/params.h"
+#include "common/statlog.h"
 #include "common/swaglog.h"
+#include "common/timing.h"
 #include "common/version.h"
 
+// ***** log files *****
+
+RawFile::RawFile(const char* path, size_t buffer_size, size_t preallocate) {
+  file = util::safe_fopen(path, "wb");
+  assert(file != nullptr);
+  if (buffer_size > 0) {
+    buffer = std::make_unique<char[]>(buffer_size);
+    setvbuf(file, buffer.get(), _IOFBF, buffer_size);
+  } else {
+    setvbuf(file, nullptr, _IONBF, 0);
+  }
+#ifdef __linux__
+  // keep the file size, readers of a file that's being written shouldn't see the reserved space
+  if (preallocate > 0 && fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, 0, preallocate) == 0) {
+    preallocated = preallocate;
+  }
+#endif
+}
+
+RawFile::~RawFile() {
+  util::safe_fflush(file);
+#ifdef __linux__
+  const int fd = fileno(file);
+  if (preallocated > written) {
+    // give back the reserved space that wasn't used
+    if (ftruncate(fd, written) != 0) {
+      LOGW("failed to release preallocated space: %s", strerror(errno));
+    }
+  }
+  // this runs on loggerd's main thread when a segment rotates, so only start the writeback of the tail and
+  // don't wait for it. the pages that are already clean are dropped now, the rest are left to the kernel.
+  sync_file_range(fd, writeback_begin, 0, SYNC_FILE_RANGE_WRITE);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+  int err = fclose(file);
+  assert(err == 0);
+}
+
+void RawFile::write(void* data, size_t size) {
+  int written_size = util::safe_fwrite(data, 1, size, file);
+  assert(written_size == size);
+  written += size;
+}
+
+void RawFile::flush() {
+  util::safe_fflush(file);
+#ifdef __linux__
+  if (written == writeback_end) return;
+
+  // start the writeback of the new data, then wait for the previous range and drop it from the page cache.
+  // the previous range had a whole flush interval to be written, so this rarely blocks.
+  const int fd = fileno(file);
+  sync_file_range(fd, writeback_end, written - writeback_end, SYNC_FILE_RANGE_WRITE);
+  if (writeback_end > writeback_begin) {
+    const size_t len = writeback_end - writeback_begin;
+    sync_file_range(fd, writeback_begin, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, writeback_begin, len, POSIX_FADV_DONTNEED);
+  }
+  writeback_begin = writeback_end;
+  writeback_end = written;
+#endif
+}
+
+// ***** buffered log files *****
+
+const size_t WRITE_BUFFER_SIZE = 4 << 20;
+const size_t WRITE_MAX_PENDING = 64 << 20;  // callers wait if the writer falls this far behind
+const size_t COMPRESS_OUT_SIZE = 1 << 16;
+const int ZSTD_LEVEL = 10;
+
+class Compressor {
+ public:
+  virtual ~Compressor() {}
+  // appends the compressed data to out, finish ends the stream
+  virtual void compress(const char* data, size_t size, bool finish, std::string &out) = 0;
+};
+
+class Bz2Compressor : public Compressor {
+ public:
+  Bz2Compressor() {
+    int ret = BZ2_bzCompressInit(&strm, 9, 0, 30);
+    assert(ret == BZ_OK);
+  }
+  ~Bz2Compressor() { BZ2_bzCompressEnd(&strm); }
+
+  void compress(const char* data, size_t size, bool finish, std::string &out) override {
+    strm.next_in = (char *)data;
+    strm.avail_in = size;
+    int ret;
+    do {
+      const size_t offset = out.size();
+      out.resize(offset + COMPRESS_OUT_SIZE);
+      strm.next_out = &out[offset];
+      strm.avail_out = COMPRESS_OUT_SIZE;
+      ret = BZ2_bzCompress(&strm, finish ? BZ_FINISH : BZ_RUN);
+      assert(ret == BZ_RUN_OK || ret == BZ_FINISH_OK || ret == BZ_STREAM_END);
+      out.resize(offset + COMPRESS_OUT_SIZE - strm.avail_out);
+    } while (finish ? ret != BZ_STREAM_END : strm.avail_in > 0);
+  }
+
+ private:
+  bz_stream strm = {};
+};
+
+class ZstdCompressor : public Compressor {
+ public:
+  ZstdCompressor() {
+    cctx = ZSTD_createCCtx();
+    assert(cctx != nullptr);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, ZSTD_LEVEL);
+  }
+  ~ZstdCompressor() { ZSTD_freeCCtx(cctx); }
+
+  void compress(const char* data, size_t size, bool finish, std::string &out) override {
+    ZSTD_inBuffer in = {.src = data, .size = size, .pos = 0};
+    size_t remaining;
+    do {
+      const size_t offset = out.size();
+      out.resize(offset + COMPRESS_OUT_SIZE);
+      ZSTD_outBuffer output = {.dst = &out[offset], .size = COMPRESS_OUT_SIZE, .pos = 0};
+      remaining = ZSTD_compressStream2(cctx, &output, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+      assert(!ZSTD_isError(remaining));
+      out.resize(offset + output.pos);
+    } while (finish ? remaining != 0 : in.pos < in.size);
+  }
+
+ private:
+  ZSTD_CCtx *cctx = nullptr;
+};
+
+static double thread_cpu_ms() {
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return t.tv_sec * 1000.0 + t.tv_nsec * 1e-6;
+}
+
+BufferedFile::BufferedFile(const char* path, LogCompression compression, size_t preallocate) : path(path) {
+  // the writer thread writes whole chunks, it doesn't need a stdio buffer
+  file = std::make_unique<RawFile>(path, 0, preallocate);
+  if (compression == LogCompression::ZSTD) {
+    compressor = std::make_unique<ZstdCompressor>();
+  } else if (compression == LogCompression::BZ2) {
+    compressor = std::make_unique<Bz2Compressor>();
+  }
+  pending.reserve(WRITE_BUFFER_SIZE);
+  thread = std::thread(&BufferedFile::writerThread, this);
+}
+
+BufferedFile::~BufferedFile() {
+  {
+    std::lock_guard lk(lock);
+    closing = true;
+  }
+  cv.notify_all();
+  thread.join();
+
+  file.reset();
+  LOGD("%s: wrote %zu bytes (%zu in), %.1f ms cpu, max write %.1f ms", path.c_str(), bytes_out, bytes_in, cpu_ms, max_write_ms);
+}
+
+void BufferedFile::write(void* data, size_t size) {
+  std::unique_lock lk(lock);
+  if (pending.size() >= WRITE_MAX_PENDING) {
+    statlog_count("loggerd_write_stalls", 1);
+    cv.wait(lk, [this] { return pending.size() < WRITE_MAX_PENDING; });
+  }
+  pending.append((const char *)data, size);
+  // only wake up the writer once per chunk
+  if (pending.size() >= WRITE_CHUNK_SIZE && pending.size() - size < WRITE_CHUNK_SIZE) {
+    lk.unlock();
+    cv.notify_all();
+  }
+}
+
+void BufferedFile::writerThread() {
+  util::set_thread_name("log_writer");
+
+  // swap buffers with the callers, so they keep appending while this chunk is written
+  std::string in, out;
+  in.reserve(WRITE_BUFFER_SIZE);
+  std::unique_lock lk(lock);
+  while (true) {
+    cv.wait_for(lk, std::chrono::milliseconds(WRITE_INTERVAL_MS),
+                [this] { return closing || pending.size() >= WRITE_CHUNK_SIZE; });
+    const bool finish = closing;
+    if (pending.empty() && !finish) continue;
+
+    in.swap(pending);
+    lk.unlock();
+    cv.notify_all();
+
+    double start_ms = millis_since_boot(), start_cpu_ms = thread_cpu_ms();
+    std::string *data = &in;
+    if (compressor) {
+      out.clear();
+      compressor->compress(in.data(), in.size(), finish, out);
+      data = &out;
+    }
+    if (!data->empty()) {
+      file->write(data->data(), data->size());
+      file->flush();
+    }
+    double write_ms = millis_since_boot() - start_ms;
+    cpu_ms += thread_cpu_ms() - start_cpu_ms;
+    max_write_ms = std::max(max_write_ms, write_ms);
+    bytes_in += in.size();
+    bytes_out += data->size();
+
+    statlog_sample("loggerd_write_queue_bytes", (int)in.size());
+    statlog_sample("loggerd_write_ms", (float)write_ms);
+    in.clear();
+
+    if (finish) break;
+    lk.lock();
+  }
+}
+
 // ***** log metadata *****
+
+// the parts of initData that can't change while the process is running
+struct InitDataStatic {
+  std::vector<std::string> kernel_args;
+  std::string kernel_version;
+  std::string os_version;
+  std::map<std::string, std::string> hw_logs;
+};
+
+static const InitDataStatic &init_data_static() {
+  static const InitDataStatic data = [] {
+    InitDataStatic d;
+    std::ifstream cmdline_stream("/proc/cmdline");
+    std::string buf;
+    while (cmdline_stream >> buf) {
+      d.kernel_args.push_back(buf);
+    }
+    d.kernel_version = util::read_file("/proc/version");
+    d.os_version = util::read_file("/VERSION");
+    d.hw_logs = Hardware::get_init_logs();
+    return d;
+  }();
+  return data;
+}
+
+// rounds up like df -h does
+static std::string human_readable_size(uint64_t bytes) {
+  if (bytes == 0) return "0";
+
+  const char units[] = "BKMGTP";
+  double size = bytes;
+  size_t i = 0;
+  for (; size >= 1024 && i < sizeof(units) - 2; ++i) {
+    size /= 1024;
+  }
+  if (i > 0 && size < 10) {
+    return util::string_format("%.1f%c", std::ceil(size * 10) / 10, units[i]);
+  }
+  return util::string_format("%.0f%c", std::ceil(size), units[i]);
+}
+
+// usage for all filesystems like "df -h", using statvfs instead of a fork/exec
+static std::string disk_usage() {
+  std::string out = "Filesystem Size Used Avail Use% Mounted on\n";
+  std::ifstream mounts("/proc/mounts");
+  std::string line;
+  while (std::getline(mounts, line)) {
+    std::istringstream fields(line);
+    std::string device, mount_point;
+    struct statvfs st;
+    if (!(fields >> device >> mount_point) || statvfs(mount_point.c_str(), &st) != 0 || st.f_blocks == 0) continue;
+
+    const uint64_t size = (uint64_t)st.f_blocks * st.f_frsize;
+    const uint64_t used = (uint64_t)(st.f_blocks - st.f_bfree) * st.f_frsize;
+    const uint64_t avail = (uint64_t)st.f_bavail * st.f_frsize;
+    const int use_percent = used + avail > 0 ? std::ceil(used * 100.0 / (used + avail)) : 0;
+    out += util::string_format("%s %s %s %s %d%% %s\n", device.c_str(), human_readable_size(size).c_str(),
+                               human_readable_size(used).c_str(), human_readable_size(avail).c_str(),
+                               use_percent, mount_point.c_str());
+  }
+  return out;
+}
+
 kj::Array<capnp::word> logger_build_init_data() {
+  const InitDataStatic &static_data = init_data_static();
+
   MessageBuilder msg;
   auto init = msg.initEvent().initInitData();
 
@@ -29,20 +324,13 @@ kj::Array<capnp::word> logger_build_init_data() {
   init.setDeviceType(Hardware::get_device_type());
 
   // log kernel args
-  std::ifstream cmdline_stream("/proc/cmdline");
-  std::vector<std::string> kernel_args;
-  std::string buf;
-  while (cmdline_stream >> buf) {
-    kernel_args.push_back(buf);
+  auto lkernel_args = init.initKernelArgs(static_data.kernel_args.size());
+  for (int i=0; i<static_data.kernel_args.size(); i++) {
+    lkernel_args.set(i, static_data.kernel_args[i]);
   }
 
-  auto lkernel_args = init.initKernelArgs(kernel_args.size());
-  for (int i=0; i<kernel_args.size(); i++) {
-    lkernel_args.set(i, kernel_args[i]);
-  }
-
-  init.setKernelVersion(util::read_file("/proc/version"));
-  init.setOsVersion(util::read_file("/VERSION"));
+  init.setKernelVersion(static_data.kernel_version);
+  init.setOsVersion(static_data.os_version);
 
   // log params
   auto params = Params();
@@ -66,31 +354,37 @@ kj::Array<capnp::word> logger_build_init_data() {
   }
 
   // log commands
-  std::vector<std::string> log_commands = {
-    "df -h",  // usage for all filesystems
+  std::map<std::string, std::string> log_commands = {
+    {"df -h", disk_usage()},
   };
 
-  auto hw_logs = Hardware::get_init_logs();
-
-  auto commands = init.initCommands().initEntries(log_commands.size() + hw_logs.size());
-  for (int i = 0; i < log_commands.size(); i++) {
-    auto lentry = commands[i];
-
-    lentry.setKey(log_commands[i]);
-
-    const std::string result = util::check_output(log_commands[i]);
-    lentry.setValue(capnp::Data::Reader((const kj::byte*)result.data(), result.size()));
+  auto commands = init.initCommands().initEntries(log_commands.size() + static_data.hw_logs.size());
+  int i = 0;
+  for (auto logs : {&log_commands, &static_data.hw_logs}) {
+    for (auto &[key, value] : *logs) {
+      auto lentry = commands[i];
+      lentry.setKey(key);
+      lentry.setValue(capnp::Data::Reader((const kj::byte*)value.data(), value.size()));
+      i++;
+    }
   }
 
-  int i = log_commands.size();
-  for (auto &[key, value] : hw_logs) {
-    auto lentry = commands[i];
-    lentry.setKey(key);
-    lentry.setValue(capnp::Data::Reader((const kj::byte*)value.data(), value.size()));
-    i++;
+  return capnp::messageToFlatArray(msg);
+}
+
+const char *log_compression_ext(LogCompression compression) {
+  switch (compression) {
+    case LogCompression::BZ2: return ".bz2";
+    case LogCompression::ZSTD: return ".zst";
+    default: return "";
   }
+}
 
-  return capnp::messageToFlatArray(msg);
+LogCompression log_compression_from_env() {
+  const std::string compression = util::getenv("LOGGERD_COMPRESSION");
+  if (compression == "zstd") return LogCompression::ZSTD;
+  if (compression == "bz2") return LogCompression::BZ2;
+  return LogCompression::NONE;
 }
 
 std::string logger_get_route_name() {
@@ -102,11 +396,48 @@ std::string logger_get_route_name() {
   return route_name;
 }
 
-void log_init_data(LoggerState *s) {
-  auto bytes = s->init_data.asBytes();
-  logger_log(s, bytes.begin(), bytes.size(), s->has_qlog);
+// logs initData to h once it's built, or waits for it if wait is set
+static void logger_log_init_data(LoggerState *s, LoggerHandle *h, bool wait) {
+  if (h->has_init_data || !s->init_data.valid()) return;
+  if (!wait && s->init_data.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+  // only one thread writes it
+  if (h->has_init_data.exchange(true)) return;
+
+  auto bytes = s->init_data.get().asBytes();
+  lh_log_init_data(h, (uint8_t *)bytes.begin(), bytes.size(), s->has_qlog);
 }
 
+static int writer_stripe() {
+  static std::atomic<int> next_stripe = 0;
+  thread_local int stripe = next_stripe++ % LOGGER_WRITER_STRIPES;
+  return stripe;
+}
+
+// the current handle, it stays open until logger_unpin. nullptr if there is none.
+// handles are never freed, so counting a writer on a handle that was just swapped out is
+// harmless. the handle is only used once it's still the current one after that.
+static LoggerHandle *logger_pin(LoggerState *s, int stripe) {
+  while (true) {
+    LoggerHandle *h = s->cur_handle;
+    if (!h) return nullptr;
+    h->writers[stripe].count++;
+    if (s->cur_handle == h) return h;
+    h->writers[stripe].count--;
+  }
+}
+
+static inline void logger_unpin(LoggerHandle *h, int stripe) {
+  h->writers[stripe].count--;
+}
+
+// waits for the writers of a handle that isn't current anymore
+static void logger_wait_for_writers(LoggerHandle *h) {
+  for (auto &w : h->writers) {
+    while (w.count > 0) {
+      std::this_thread::yield();
+    }
+  }
+}
 
 static void lh_log_sentinel(LoggerHandle *h, SentinelType type) {
   MessageBuilder msg;
@@ -118,15 +449,103 @@ static void lh_log_sentinel(LoggerHandle *h, SentinelType type) {
   lh_log(h, bytes.begin(), bytes.size(), true);
 }
 
+// ***** closing logs *****
+
+static void lh_write_index(const char *log_path, const LogIndex &index) {
+  const std::string path = log_index_path(log_path);
+  const std::string data = index.serialize();
+  if (util::write_file(path.c_str(), data.data(), data.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0) {
+    LOGE("failed to write log index %s", path.c_str());
+  }
+}
+
+// finishing a log compresses and writes everything that's still pending, that can take a while with
+// bz2 or slow storage. closed handles are finished by this thread so rotation doesn't stall loggerd.
+class LogCloser {
+ public:
+  struct Logs {
+    std::unique_ptr<LogFile> log, q_log;
+    LogIndex log_index, q_log_index;
+    std::string log_path, qlog_path, lock_path;
+  };
+
+  LogCloser() : thread(&LogCloser::closerThread, this) {}
+  ~LogCloser() {
+    {
+      std::lock_guard lk(lock);
+      exit = true;
+    }
+    cv.notify_all();
+    thread.join();
+  }
+
+  void close(Logs &&logs) {
+    {
+      std::lock_guard lk(lock);
+      queue.push_back(std::move(logs));
+    }
+    cv.notify_all();
+  }
+
+  // waits until the logs handed over so far are closed
+  void wait() {
+    std::unique_lock lk(lock);
+    cv.wait(lk, [this] { return queue.empty() && !closing; });
+  }
+
+ private:
+  void closerThread() {
+    util::set_thread_name("log_closer");
+
+    std::unique_lock lk(lock);
+    while (true) {
+      cv.wait(lk, [this] { return exit || !queue.empty(); });
+      if (queue.empty()) break;
+
+      Logs logs = std::move(queue.front());
+      queue.pop_front();
+      closing = true;
+      lk.unlock();
+
+      logs.log.reset();
+      lh_write_index(logs.log_path.c_str(), logs.log_index);
+      if (logs.q_log) {
+        logs.q_log.reset();
+        lh_write_index(logs.qlog_path.c_str(), logs.q_log_index);
+      }
+      // the segment can be uploaded from here
+      unlink(logs.lock_path.c_str());
+
+      lk.lock();
+      closing = false;
+      cv.notify_all();
+    }
+  }
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<Logs> queue;
+  bool closing = false;
+  bool exit = false;
+  std::thread thread;
+};
+
+static LogCloser &log_closer() {
+  static LogCloser closer;
+  return closer;
+}
+
 // ***** logging functions *****
 
-void logger_init(LoggerState *s, bool has_qlog) {
+void logger_init(LoggerState *s, bool has_qlog, LogCompression compression) {
   pthread_mutex_init(&s->lock, NULL);
 
   s->part = -1;
   s->has_qlog = has_qlog;
+  s->compression = compression;
   s->route_name = logger_get_route_name();
-  s->init_data = logger_build_init_data();
+  // reading params and the hardware logs takes a while, the route starts logging without waiting for them
+  s->init_data = std::async(std::launch::async, logger_build_init_data).share();
 }
 
 static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
@@ -142,11 +561,19 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   snprintf(h->segment_path, sizeof(h->segment_path),
           "%s/%s--%d", root_path, s->route_name.c_str(), s->part);
 
-  snprintf(h->log_path, sizeof(h->log_path), "%s/rlog", h->segment_path);
-  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog", h->segment_path);
-  snprintf(h->lock_path, sizeof(h->lock_path), "%s.lock", h->log_path);
+  const char *ext = log_compression_ext(s->compression);
+  snprintf(h->log_path, sizeof(h->log_path), "%s/rlog%s", h->segment_path, ext);
+  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog%s", h->segment_path, ext);
+  snprintf(h->lock_path, sizeof(h->lock_path), "%s/rlog.lock", h->segment_path);
   h->end_sentinel_type = SentinelType::END_OF_SEGMENT;
   h->exit_signal = 0;
+  h->log_size = h->q_log_size = 0;
+  h->log_index.clear();
+  h->q_log_index.clear();
+  // without an initData to wait for, nothing is held
+  h->has_init_data = !s->init_data.valid();
+  h->init_data_written = h->has_init_data;
+  h->held_msgs.clear();
 
   if (!util::create_directories(h->segment_path, 0775)) return nullptr;
 
@@ -154,9 +581,20 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   if (lock_file == NULL) return NULL;
   fclose(lock_file);
 
-  h->log = std::make_unique<RawFile>(h->log_path);
+  // segments are about the same size, reserve the size of the previous one.
+  // compressed sizes aren't known up front, those files are small anyway.
+  uint64_t prev_log_size = 0, prev_q_log_size = 0;
+  LoggerHandle *prev_h = s->cur_handle;
+  if (prev_h && s->compression == LogCompression::NONE) {
+    pthread_mutex_lock(&prev_h->lock);
+    prev_log_size = prev_h->log_size;
+    prev_q_log_size = prev_h->q_log_size;
+    pthread_mutex_unlock(&prev_h->lock);
+  }
+
+  h->log = std::make_unique<BufferedFile>(h->log_path, s->compression, prev_log_size);
   if (s->has_qlog) {
-    h->q_log = std::make_unique<RawFile>(h->qlog_path);
+    h->q_log = std::make_unique<BufferedFile>(h->qlog_path, s->compression, prev_q_log_size);
   }
 
   pthread_mutex_init(&h->lock, NULL);
@@ -167,21 +605,32 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
 int logger_next(LoggerState *s, const char* root_path,
                             char* out_segment_path, size_t out_segment_path_len,
                             int* out_part) {
-  bool is_start_of_route = !s->cur_handle;
-
+  // the logging threads keep writing to the current segment while the next one is opened
   pthread_mutex_lock(&s->lock);
   s->part++;
 
+  if (LoggerHandle *cur_h = s->cur_handle) {
+    // every segment gets initData, even if nothing was logged through logger_log.
+    // it's always ready after the first segment, so the next one is never held
+    logger_log_init_data(s, cur_h, true);
+  }
+
   LoggerHandle* next_h = logger_open(s, root_path);
   if (!next_h) {
     pthread_mutex_unlock(&s->lock);
     return -1;
   }
 
-  if (s->cur_handle) {
-    lh_close(s->cur_handle);
+  // the beginning of the segment is written before other threads can see it. in the first segment
+  // initData may still be building, then the sentinel and the first messages are held until it's ready
+  logger_log_init_data(s, next_h, false);
+  lh_log_sentinel(next_h, s->part == 0 ? SentinelType::START_OF_ROUTE : SentinelType::START_OF_SEGMENT);
+
+  LoggerHandle *prev_h = s->cur_handle.exchange(next_h);
+  if (prev_h) {
+    logger_wait_for_writers(prev_h);
+    lh_close(prev_h);
   }
-  s->cur_handle = next_h;
 
   if (out_segment_path) {
     snprintf(out_segment_path, out_segment_path_len, "%s", next_h->segment_path);
@@ -191,53 +640,106 @@ int logger_next(LoggerState *s, const char* root_path,
   }
 
   pthread_mutex_unlock(&s->lock);
-
-  // write beginning of log metadata
-  log_init_data(s);
-  lh_log_sentinel(s->cur_handle, is_start_of_route ? SentinelType::START_OF_ROUTE : SentinelType::START_OF_SEGMENT);
   return 0;
 }
 
 LoggerHandle* logger_get_handle(LoggerState *s) {
-  pthread_mutex_lock(&s->lock);
-  LoggerHandle* h = s->cur_handle;
+  const int stripe = writer_stripe();
+  LoggerHandle* h = logger_pin(s, stripe);
   if (h) {
-    pthread_mutex_lock(&h->lock);
     h->refcnt++;
-    pthread_mutex_unlock(&h->lock);
+    logger_unpin(h, stripe);
   }
-  pthread_mutex_unlock(&s->lock);
   return h;
 }
 
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog) {
-  pthread_mutex_lock(&s->lock);
-  if (s->cur_handle) {
-    lh_log(s->cur_handle, data, data_size, in_qlog);
+  const int stripe = writer_stripe();
+  LoggerHandle *h = logger_pin(s, stripe);
+  if (h) {
+    logger_log_init_data(s, h, false);
+    lh_log(h, data, data_size, in_qlog);
+    logger_unpin(h, stripe);
   }
-  pthread_mutex_unlock(&s->lock);
 }
 
 void logger_close(LoggerState *s, ExitHandler *exit_handler) {
   pthread_mutex_lock(&s->lock);
-  if (s->cur_handle) {
-    s->cur_handle->exit_signal = exit_handler && exit_handler->signal.load();
-    s->cur_handle->end_sentinel_type = SentinelType::END_OF_ROUTE;
-    lh_close(s->cur_handle);
+  LoggerHandle *h = s->cur_handle.exchange(nullptr);
+  if (h) {
+    logger_wait_for_writers(h);
+    logger_log_init_data(s, h, true);
+    h->exit_signal = exit_handler && exit_handler->signal.load();
+    h->end_sentinel_type = SentinelType::END_OF_ROUTE;
+    lh_close(h);
   }
+  // the route is complete once its last logs are closed
+  log_closer().wait();
   pthread_mutex_unlock(&s->lock);
 }
 
-void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog) {
-  pthread_mutex_lock(&h->lock);
-  assert(h->refcnt > 0);
+struct MessageKey {
+  bool indexed = false;
+  uint16_t which = 0;
+  uint64_t mono_time = 0;
+};
+
+// only the root struct is read, to index the message
+static MessageKey lh_index_message(uint8_t* data, size_t data_size) {
+  MessageKey key;
+  try {
+    capnp::FlatArrayMessageReader cmsg(kj::ArrayPtr<capnp::word>((capnp::word *)data, data_size / sizeof(capnp::word)));
+    auto event = cmsg.getRoot<cereal::Event>();
+    key.which = (uint16_t)event.which();
+    key.mono_time = event.getLogMonoTime();
+    key.indexed = true;
+  } catch (const kj::Exception &e) {
+    LOGE("failed to index message: %s", e.getDescription().cStr());
+  }
+  return key;
+}
+
+// h->lock must be held
+static void lh_write(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog, const MessageKey &key) {
   h->log->write(data, data_size);
+  if (key.indexed) h->log_index.add(key.which, key.mono_time, h->log_size, h->log_size + data_size);
+  h->log_size += data_size;
   if (in_qlog && h->q_log) {
     h->q_log->write(data, data_size);
+    if (key.indexed) h->q_log_index.add(key.which, key.mono_time, h->q_log_size, h->q_log_size + data_size);
+    h->q_log_size += data_size;
+  }
+}
+
+void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog) {
+  const MessageKey key = lh_index_message(data, data_size);
+
+  pthread_mutex_lock(&h->lock);
+  assert(h->refcnt > 0);
+  if (h->init_data_written) {
+    lh_write(h, data, data_size, in_qlog, key);
+  } else {
+    // initData is the first message of every log, the ones before it wait until it's ready
+    h->held_msgs.emplace_back(std::string((const char *)data, data_size), in_qlog);
   }
   pthread_mutex_unlock(&h->lock);
 }
 
+void lh_log_init_data(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog) {
+  const MessageKey key = lh_index_message(data, data_size);
+
+  pthread_mutex_lock(&h->lock);
+  assert(h->refcnt > 0 && !h->init_data_written);
+  lh_write(h, data, data_size, in_qlog, key);
+  for (auto &[msg, msg_in_qlog] : h->held_msgs) {
+    lh_write(h, (uint8_t *)msg.data(), msg.size(), msg_in_qlog, lh_index_message((uint8_t *)msg.data(), msg.size()));
+  }
+  h->held_msgs.clear();
+  h->held_msgs.shrink_to_fit();
+  h->init_data_written = true;
+  pthread_mutex_unlock(&h->lock);
+}
+
 void lh_close(LoggerHandle* h) {
   pthread_mutex_lock(&h->lock);
   assert(h->refcnt > 0);
@@ -247,14 +749,16 @@ void lh_close(LoggerHandle* h) {
     lh_log_sentinel(h, h->end_sentinel_type);
     pthread_mutex_lock(&h->lock);
   }
-  h->refcnt--;
-  if (h->refcnt == 0) {
-    h->log.reset(nullptr);
-    h->q_log.reset(nullptr);
-    unlink(h->lock_path);
+  if (h->refcnt == 1) {
+    assert(h->init_data_written);
+    log_closer().close({std::move(h->log), std::move(h->q_log), std::move(h->log_index), std::move(h->q_log_index),
+                        h->log_path, h->qlog_path, h->lock_path});
     pthread_mutex_unlock(&h->lock);
     pthread_mutex_destroy(&h->lock);
+    // logger_open can reuse the handle from here
+    h->refcnt = 0;
     return;
   }
+  h->refcnt--;
   pthread_mutex_unlock(&h->lock);
 }
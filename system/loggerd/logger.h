@@ -3,9 +3,17 @@
 #include <cassert>
 #include <pthread.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <capnp/serialize.h>
 #include <kj/array.h>
@@ -14,30 +22,81 @@
 #include "common/util.h"
 #include "common/swaglog.h"
 #include "system/hardware/hw.h"
+#include "system/loggerd/logindex.h"
 
 const std::string LOG_ROOT = Path::log_root();
 
 #define LOGGER_MAX_HANDLES 16
+#define LOGGER_WRITER_STRIPES 8
+#define RAW_FILE_BUFFER_SIZE (1 << 20)
 
-class RawFile {
+enum class LogCompression {
+  NONE,
+  BZ2,
+  ZSTD,
+};
+
+class LogFile {
  public:
-  RawFile(const char* path) {
-    file = util::safe_fopen(path, "wb");
-    assert(file != nullptr);
-  }
-  ~RawFile() {
-    util::safe_fflush(file);
-    int err = fclose(file);
-    assert(err == 0);
-  }
-  inline void write(void* data, size_t size) {
-    int written = util::safe_fwrite(data, 1, size, file);
-    assert(written == size);
-  }
+  virtual ~LogFile() {}
+  virtual void write(void* data, size_t size) = 0;
   inline void write(kj::ArrayPtr<capnp::byte> array) { write(array.begin(), array.size()); }
+};
+
+// a file written through a large stdio buffer. preallocate reserves disk space up front
+// (e.g. the size of the previous segment) so the file doesn't grow in many small extents.
+// data that was flushed is written back and dropped from the page cache, nothing reads
+// the logs again while loggerd is running.
+class RawFile : public LogFile {
+ public:
+  RawFile(const char* path, size_t buffer_size = RAW_FILE_BUFFER_SIZE, size_t preallocate = 0);
+  ~RawFile();
+  using LogFile::write;
+  void write(void* data, size_t size) override;
+  // writes the buffer to the file and starts its writeback
+  void flush();
+  inline size_t size() const { return written; }
 
  private:
   FILE* file = nullptr;
+  std::unique_ptr<char[]> buffer;
+  size_t preallocated = 0;
+  size_t written = 0;
+  size_t writeback_begin = 0, writeback_end = 0;  // range whose writeback was started by flush()
+};
+
+class Compressor;
+
+// the writer wakes up every WRITE_CHUNK_SIZE bytes or WRITE_INTERVAL_MS, so that's how long data can wait in memory
+const size_t WRITE_CHUNK_SIZE = 1 << 20;
+const int WRITE_INTERVAL_MS = 1000;
+
+// write() only copies into a preallocated buffer. a writer thread swaps it with a
+// second buffer, compresses it if needed and writes it to disk, so slow storage
+// never blocks the callers. the stream is finished when the file is destroyed.
+class BufferedFile : public LogFile {
+ public:
+  BufferedFile(const char* path, LogCompression compression = LogCompression::NONE, size_t preallocate = 0);
+  ~BufferedFile();
+  using LogFile::write;
+  void write(void* data, size_t size) override;
+
+ private:
+  void writerThread();
+
+  std::string path;
+  std::unique_ptr<RawFile> file;
+  std::unique_ptr<Compressor> compressor;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::string pending;
+  bool closing = false;
+  std::thread thread;
+
+  // stats, only touched by the writer thread
+  size_t bytes_in = 0, bytes_out = 0;
+  double cpu_ms = 0, max_write_ms = 0;
 };
 
 typedef cereal::Sentinel::SentinelType SentinelType;
@@ -46,29 +105,47 @@ typedef struct LoggerHandle {
   pthread_mutex_t lock;
   SentinelType end_sentinel_type;
   int exit_signal;
-  int refcnt;
+  std::atomic<int> refcnt;
   char segment_path[4096];
   char log_path[4096];
   char qlog_path[4096];
   char lock_path[4096];
-  std::unique_ptr<RawFile> log, q_log;
+  std::unique_ptr<LogFile> log, q_log;
+  // seek index, written next to the logs when the handle is closed
+  LogIndex log_index, q_log_index;
+  uint64_t log_size, q_log_size;
+  std::atomic<bool> has_init_data;
+  // the messages logged before initData was ready, they are written right after it. guarded by lock
+  bool init_data_written;
+  std::vector<std::pair<std::string, bool>> held_msgs;
+  // threads that are using this handle as the current one, rotation waits for them before closing it.
+  // striped by thread so logging threads don't share a cache line.
+  struct alignas(64) {
+    std::atomic<int> count;
+  } writers[LOGGER_WRITER_STRIPES];
 } LoggerHandle;
 
 typedef struct LoggerState {
-  pthread_mutex_t lock;
+  pthread_mutex_t lock;  // serializes rotation and closing, logging never takes it
   int part;
-  kj::Array<capnp::word> init_data;
+  // built in the background by logger_init
+  std::shared_future<kj::Array<capnp::word>> init_data;
   std::string route_name;
   char log_name[64];
   bool has_qlog;
+  LogCompression compression;
 
   LoggerHandle handles[LOGGER_MAX_HANDLES];
-  LoggerHandle* cur_handle;
+  // swapped by rotation, logging threads only load it
+  std::atomic<LoggerHandle*> cur_handle;
 } LoggerState;
 
 kj::Array<capnp::word> logger_build_init_data();
+const char *log_compression_ext(LogCompression compression);
+// LOGGERD_COMPRESSION=zstd|bz2, uncompressed logs by default
+LogCompression log_compression_from_env();
 std::string logger_get_route_name();
-void logger_init(LoggerState *s, bool has_qlog);
+void logger_init(LoggerState *s, bool has_qlog, LogCompression compression = LogCompression::NONE);
 int logger_next(LoggerState *s, const char* root_path,
                             char* out_segment_path, size_t out_segment_path_len,
                             int* out_part);
@@ -77,4 +154,7 @@ void logger_close(LoggerState *s, ExitHandler *exit_handler=nullptr);
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
 
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
+// writes initData, followed by the messages that were held until it was ready
+void lh_log_init_data(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
+// the last reference finishes the logs in the background, logger_close waits for them
 void lh_close(LoggerHandle* h);
@@ -1,5 +1,6 @@
 #include <sys/xattr.h>
 
+#include <algorithm>
 #include <unordered_map>
 
 #include "system/loggerd/encoder/encoder.h"
@@ -52,22 +53,68 @@ void rotate_if_needed(LoggerdState *s) {
   }
 }
 
+// encoder packets that arrive before loggerd has rotated to their segment. they're copied into
+// one buffer, allocated by the first packet. the ones that don't fit, like the lossless packets
+// on PC or everything after a long wait for a lagging camera, get their own heap copy.
+class PacketArena {
+public:
+  // returns false if the packet didn't fit in the buffer
+  bool push(kj::ArrayPtr<capnp::word> data, size_t capacity_words) {
+    if (!buf) {
+      buf = std::make_unique<capnp::word[]>(capacity_words);
+      capacity = capacity_words;
+      packets.reserve(ENCODER_ARENA_RESERVE_PACKETS);
+    }
+    if (used + data.size() > capacity) {
+      overflow.push_back(kj::heapArray<capnp::word>(data));
+      packets.push_back(overflow.back().asPtr());
+      return false;
+    }
+    memcpy(&buf[used], data.begin(), data.size() * sizeof(capnp::word));
+    packets.push_back(kj::arrayPtr(&buf[used], data.size()));
+    used += data.size();
+    return true;
+  }
+  inline void clear() { packets.clear(); overflow.clear(); used = 0; }
+  // clear and free the buffer, packets are only queued around rotations
+  inline void release() {
+    clear();
+    buf.reset();
+    capacity = 0;
+    packets.shrink_to_fit();
+    overflow.shrink_to_fit();
+  }
+  inline bool empty() const { return packets.empty(); }
+  inline size_t overflowed() const { return overflow.size(); }
+  inline auto begin() const { return packets.begin(); }
+  inline auto end() const { return packets.end(); }
+
+private:
+  std::unique_ptr<capnp::word[]> buf;
+  size_t capacity = 0;  // in words
+  size_t used = 0;
+  std::vector<kj::Array<capnp::word>> overflow;
+  std::vector<kj::ArrayPtr<capnp::word>> packets;
+};
+
 struct RemoteEncoder {
   std::unique_ptr<VideoWriter> writer;
   int encoderd_segment_offset;
   int current_segment = -1;
-  std::vector<Message *> q;
+  // packets for the next segment, and the ones being handled after the rotation
+  PacketArena q, draining_q;
   int dropped_frames = 0;
   bool recording = false;
   bool marked_ready_to_rotate = false;
   bool seen_first_packet = false;
 };
 
-int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct RemoteEncoder &re, const EncoderInfo &encoder_info) {
+// the encoder data is written straight from the received buffer, the caller keeps ownership
+int handle_encoder_msg(LoggerdState *s, kj::ArrayPtr<capnp::word> words, std::string &name, struct RemoteEncoder &re, const EncoderInfo &encoder_info) {
   int bytes_count = 0;
 
   // extract the message
-  capnp::FlatArrayMessageReader cmsg(kj::ArrayPtr<capnp::word>((capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word)));
+  capnp::FlatArrayMessageReader cmsg(words);
   auto event = cmsg.getRoot<cereal::Event>();
   auto edata = (event.*(encoder_info.get_encode_data_func))();
   auto idx = edata.getIdx();
@@ -92,12 +139,14 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
       }
       re.current_segment = s->rotate_segment;
       re.marked_ready_to_rotate = false;
-      // we are in this segment now, process any queued messages before this one
+      // we are in this segment now, process any queued messages before this one.
+      // packets for later segments are queued again into the other arena
       if (!re.q.empty()) {
-        for (auto &qmsg: re.q) {
-          bytes_count += handle_encoder_msg(s, qmsg, name, re, encoder_info);
+        std::swap(re.q, re.draining_q);
+        for (auto qwords : re.draining_q) {
+          bytes_count += handle_encoder_msg(s, qwords, name, re, encoder_info);
         }
-        re.q.clear();
+        re.draining_q.release();
       }
     }
 
@@ -123,7 +172,6 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
       } else {
         // this is a sad case when we aren't recording, but don't have an iframe
         // nothing we can do but drop the frame
-        delete msg;
         ++re.dropped_frames;
         return bytes_count;
       }
@@ -138,17 +186,21 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
       re.writer->write((uint8_t *)data.begin(), data.size(), idx.getTimestampEof()/1000, false, flags & V4L2_BUF_FLAG_KEYFRAME);
     }
 
-    // put it in log stream as the idx packet
-    MessageBuilder bmsg;
-    auto evt = bmsg.initEvent(event.getValid());
+    // put it in log stream as the idx packet. the idx event is small, so it's built
+    // and serialized in buffers on the stack instead of the heap
+    capnp::word scratch[ENCODE_IDX_SCRATCH_WORDS] = {};
+    capnp::MallocMessageBuilder bmsg(kj::arrayPtr(scratch, ENCODE_IDX_SCRATCH_WORDS));
+    auto evt = bmsg.initRoot<cereal::Event>();
+    evt.setValid(event.getValid());
     evt.setLogMonoTime(event.getLogMonoTime());
     (evt.*(encoder_info.set_encode_idx_func))(idx);
-    auto new_msg = bmsg.toBytes();
+
+    capnp::word out[ENCODE_IDX_SCRATCH_WORDS];
+    kj::ArrayOutputStream stream(kj::arrayPtr((capnp::byte *)out, sizeof(out)));
+    capnp::writeMessage(stream, bmsg);
+    auto new_msg = stream.getArray();
     logger_log(&s->logger, (uint8_t *)new_msg.begin(), new_msg.size(), true);   // always in qlog?
     bytes_count += new_msg.size();
-
-    // free the message, we used it
-    delete msg;
   } else if (offset_segment_num > s->rotate_segment) {
     // encoderd packet has a newer segment, this means encoderd has rolled over
     if (!re.marked_ready_to_rotate) {
@@ -159,14 +211,16 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
         s->ready_to_rotate.load(), s->max_waiting, name.c_str());
     }
     // queue up all the new segment messages, they go in after the rotate
-    re.q.push_back(msg);
+    const size_t arena_bytes = std::max<size_t>((size_t)encoder_info.bitrate / 8 * ENCODER_ARENA_SECONDS, ENCODER_ARENA_MIN_BYTES);
+    if (!re.q.push(words, arena_bytes / sizeof(capnp::word)) && re.q.overflowed() == 1) {
+      LOGW("%s: encoder queue doesn't fit in %zu bytes, copying packets for segment %d", name.c_str(), arena_bytes, offset_segment_num);
+    }
   } else {
     LOGE("%s: encoderd packet has a older segment!!! idx.getSegmentNum():%d s->rotate_segment:%d re.encoderd_segment_offset:%d",
       name.c_str(), idx.getSegmentNum(), s->rotate_segment.load(), re.encoderd_segment_offset);
-    // free the message, it's useless. this should never happen
+    // drop the message, it's useless. this should never happen
     // actually, this can happen if you restart encoderd
     re.encoderd_segment_offset = -s->rotate_segment.load();
-    delete msg;
   }
 
   return bytes_count;
@@ -223,7 +277,7 @@ void loggerd_thread() {
 
   LoggerdState s;
   // init logger
-  logger_init(&s.logger, true);
+  logger_init(&s.logger, true, log_compression_from_env());
   logger_rotate(&s);
   Params().put("CurrentRoute", s.logger.route_name);
 
@@ -254,12 +308,13 @@ void loggerd_thread() {
         const bool in_qlog = service.freq != -1 && (service.counter++ % service.freq == 0);
         if (service.encoder) {
           s.last_camera_seen_tms = millis_since_boot();
-          bytes_count += handle_encoder_msg(&s, msg, service.name, remote_encoders[sock], encoder_infos_dict[service.name]);
+          kj::ArrayPtr<capnp::word> words((capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word));
+          bytes_count += handle_encoder_msg(&s, words, service.name, remote_encoders[sock], encoder_infos_dict[service.name]);
         } else {
           logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
           bytes_count += msg->getSize();
-          delete msg;
         }
+        delete msg;
 
         rotate_if_needed(&s);
 
@@ -18,6 +18,14 @@ const int QCAM_BITRATE = 256000;
 
 #define NO_CAMERA_PATIENCE 500  // fall back to time-based rotation if all cameras are dead
 
+// per encoder buffer for the packets queued while waiting for the other encoders to rotate:
+// a second of video at the encoder's bitrate, at least enough for a few keyframes.
+// packets that don't fit are copied to the heap, nothing is dropped until the rotation times out
+const int ENCODER_ARENA_SECONDS = 1;
+const size_t ENCODER_ARENA_MIN_BYTES = 512 << 10;
+const size_t ENCODER_ARENA_RESERVE_PACKETS = 256;
+const size_t ENCODE_IDX_SCRATCH_WORDS = 256;
+
 #define INIT_ENCODE_FUNCTIONS(encode_type)                                \
   .get_encode_data_func = &cereal::Event::Reader::get##encode_type##Data, \
   .set_encode_idx_func = &cereal::Event::Builder::set##encode_type##Idx,  \
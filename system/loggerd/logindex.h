@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Seek index loggerd writes next to every rlog/qlog (rlog.idx, qlog.idx).
+// For each service it keeps the message count, the end of its last message and the
+// (logMonoTime, offset) of every LOG_INDEX_STRIDE-th message, starting with the first.
+// Offsets are into the uncompressed log.
+
+const char LOG_INDEX_MAGIC[4] = {'L', 'I', 'D', 'X'};
+const uint16_t LOG_INDEX_VERSION = 1;
+const uint32_t LOG_INDEX_STRIDE = 64;
+
+struct LogIndexEntry {
+  uint64_t mono_time;
+  uint64_t offset;
+};
+
+struct LogIndexService {
+  uint32_t count = 0;
+  uint64_t end_offset = 0;
+  std::vector<LogIndexEntry> entries;
+};
+
+class LogIndex {
+public:
+  inline void add(uint16_t which, uint64_t mono_time, uint64_t offset, uint64_t end_offset) {
+    auto &s = services[which];
+    if (s.count++ % stride == 0) {
+      s.entries.push_back({mono_time, offset});
+    }
+    s.end_offset = end_offset;
+  }
+
+  inline void clear() {
+    services.clear();
+    stride = LOG_INDEX_STRIDE;
+  }
+
+  // total messages of the services in allow, all services if it's empty
+  inline size_t count(const std::set<uint16_t> &allow = {}) const {
+    size_t cnt = 0;
+    for (auto &[which, s] : services) {
+      if (allow.empty() || allow.count(which)) cnt += s.count;
+    }
+    return cnt;
+  }
+
+  // byte range of the log that holds every message of the services in allow
+  // logged within [begin_mono_time, end_mono_time], at the granularity of the stride.
+  inline std::pair<uint64_t, uint64_t> range(const std::set<uint16_t> &allow = {},
+                                             uint64_t begin_mono_time = 0, uint64_t end_mono_time = UINT64_MAX) const {
+    uint64_t begin = UINT64_MAX, end = 0;
+    for (auto &[which, s] : services) {
+      if ((!allow.empty() && !allow.count(which)) || s.entries.empty()) continue;
+
+      auto cmp = [](uint64_t t, const LogIndexEntry &e) { return t < e.mono_time; };
+      // the last entry at or before begin_mono_time, and the first one after end_mono_time
+      auto first = std::upper_bound(s.entries.begin(), s.entries.end(), begin_mono_time, cmp);
+      auto last = std::upper_bound(first, s.entries.end(), end_mono_time, cmp);
+      if (last == s.entries.begin()) continue;  // everything is after the range
+
+      begin = std::min(begin, (first == s.entries.begin() ? first : first - 1)->offset);
+      end = std::max(end, last == s.entries.end() ? s.end_offset : last->offset);
+    }
+    return begin < end ? std::make_pair(begin, end) : std::make_pair<uint64_t, uint64_t>(0, 0);
+  }
+
+  std::string serialize() const {
+    std::string out(LOG_INDEX_MAGIC, sizeof(LOG_INDEX_MAGIC));
+    append(out, LOG_INDEX_VERSION);
+    append(out, (uint16_t)0);
+    append(out, stride);
+    append(out, (uint32_t)services.size());
+    for (auto &[which, s] : services) {
+      append(out, which);
+      append(out, (uint16_t)0);
+      append(out, s.count);
+      append(out, s.end_offset);
+      append(out, (uint64_t)s.entries.size());
+      out.append((const char *)s.entries.data(), s.entries.size() * sizeof(LogIndexEntry));
+    }
+    return out;
+  }
+
+  bool deserialize(const std::string &data) {
+    clear();
+    size_t pos = sizeof(LOG_INDEX_MAGIC);
+    uint16_t version = 0, reserved = 0;
+    uint32_t service_cnt = 0;
+    if (data.size() < pos || memcmp(data.data(), LOG_INDEX_MAGIC, pos) != 0 ||
+        !read(data, pos, version) || version != LOG_INDEX_VERSION ||
+        !read(data, pos, reserved) || !read(data, pos, stride) || stride == 0 || !read(data, pos, service_cnt)) {
+      clear();
+      return false;
+    }
+
+    for (uint32_t i = 0; i < service_cnt; ++i) {
+      uint16_t which = 0;
+      uint64_t entry_cnt = 0;
+      LogIndexService s;
+      if (!read(data, pos, which) || !read(data, pos, reserved) || !read(data, pos, s.count) ||
+          !read(data, pos, s.end_offset) || !read(data, pos, entry_cnt) ||
+          entry_cnt > (data.size() - pos) / sizeof(LogIndexEntry)) {
+        clear();
+        return false;
+      }
+      s.entries.resize(entry_cnt);
+      memcpy(s.entries.data(), &data[pos], entry_cnt * sizeof(LogIndexEntry));
+      pos += entry_cnt * sizeof(LogIndexEntry);
+      services[which] = std::move(s);
+    }
+    if (pos != data.size()) {
+      clear();
+      return false;
+    }
+    return true;
+  }
+
+  uint32_t stride = LOG_INDEX_STRIDE;
+  std::map<uint16_t, LogIndexService> services;
+
+private:
+  template <class T>
+  static void append(std::string &out, T v) { out.append((const char *)&v, sizeof(v)); }
+
+  template <class T>
+  static bool read(const std::string &data, size_t &pos, T &v) {
+    if (data.size() - pos < sizeof(v)) return false;
+    memcpy(&v, &data[pos], sizeof(v));
+    pos += sizeof(v);
+    return true;
+  }
+};
+
+// rlog, rlog.bz2 and rlog.zst are all indexed by rlog.idx
+inline std::string log_index_path(const std::string &log_path) {
+  std::string path = log_path;
+  for (const char *ext : {".bz2", ".zst"}) {
+    const size_t len = strlen(ext);
+    if (path.size() > len && path.compare(path.size() - len, len, ext) == 0) {
+      path.resize(path.size() - len);
+      break;
+    }
+  }
+  return path + ".idx";
+}
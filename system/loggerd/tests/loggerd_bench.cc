@@ -0,0 +1,278 @@
+// loggerd throughput benchmark. publishes synthetic messages for every logged service at
+// (a multiple of) its frequency from the service table and measures what ends up in the rlog.
+//
+//   ./loggerd_bench [--seconds 10] [--rate 1.0] [--direct]
+//
+// by default it runs ../loggerd and follows its rlog, so the latency is from publishing a message
+// to it being readable in the rlog. that includes the up to WRITE_INTERVAL_MS the log writer waits
+// for a chunk and the poll period of the follower, both are printed with the numbers.
+// --direct calls logger_log() in-process instead of going through msgq and loggerd's poll loop,
+// the latency is then the time spent in logger_log(), and nothing can be dropped.
+
+#include <getopt.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <capnp/dynamic.h>
+#include <capnp/schema.h>
+
+#include "cereal/messaging/messaging.h"
+#include "cereal/services.h"
+#include "common/timing.h"
+#include "common/util.h"
+#include "system/loggerd/logger.h"
+
+const std::string BENCH_LOG_ROOT = "/tmp/loggerd_bench";
+const int FOLLOW_INTERVAL_MS = 10;
+
+struct ServiceStats {
+  uint64_t sent = 0, logged = 0, bytes = 0;
+};
+
+struct Publisher {
+  std::string name;
+  double interval_ms;
+  double next_ms;
+  std::unique_ptr<PubSocket> sock;
+  std::unique_ptr<MessageBuilder> msg;
+};
+
+// an empty message of the service, which() is the service's field like the real one
+std::unique_ptr<MessageBuilder> build_msg(const std::string &name) {
+  auto msg = std::make_unique<MessageBuilder>();
+  auto event = capnp::toDynamic(msg->initEvent());
+  auto field = event.getSchema().getFieldByName(name);
+  if (field.getType().isStruct()) {
+    event.init(field);
+  } else {
+    event.clear(field);
+  }
+  return msg;
+}
+
+std::string event_name(const cereal::Event::Reader &event) {
+  KJ_IF_MAYBE(field, capnp::toDynamic(event).which()) {
+    return field->getProto().getName().cStr();
+  }
+  return "";
+}
+
+double percentile(std::vector<double> &v, double p) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, (size_t)(v.size() * p))];
+}
+
+// follows the rlogs of the route being written, segment by segment
+class RlogFollower {
+public:
+  // parses the messages written since the last call, returns false once the route has ended
+  bool update(std::map<std::string, ServiceStats> &stats, std::vector<double> &latency_ms) {
+    if (path.empty()) {
+      const std::string route = find_route();
+      if (route.empty()) return true;
+      path = BENCH_LOG_ROOT + "/" + route + "--0/rlog";
+    }
+
+    std::unique_ptr<FILE, decltype(&fclose)> f(fopen(path.c_str(), "rb"), &fclose);
+    if (!f) return true;
+    fseek(f.get(), offset, SEEK_SET);
+    char tmp[1 << 16];
+    size_t n = 0;
+    while ((n = fread(tmp, 1, sizeof(tmp), f.get())) > 0) {
+      buf.append(tmp, n);
+      offset += n;
+    }
+
+    const double now_ms = millis_since_boot();
+    kj::ArrayPtr<const capnp::word> words((const capnp::word *)buf.data(), buf.size() / sizeof(capnp::word));
+    while (words.size() > 0) {
+      try {
+        capnp::FlatArrayMessageReader reader(words);
+        auto event = reader.getRoot<cereal::Event>();
+        words = kj::arrayPtr(reader.getEnd(), words.end());
+        if (event.isSentinel()) {
+          auto type = event.getSentinel().getType();
+          if (type == cereal::Sentinel::SentinelType::END_OF_ROUTE) return false;
+          if (type == cereal::Sentinel::SentinelType::END_OF_SEGMENT) {
+            next_segment();
+            return true;
+          }
+        } else if (auto it = stats.find(event_name(event)); it != stats.end()) {
+          ++it->second.logged;
+          latency_ms.push_back(now_ms - event.getLogMonoTime() / 1e6);
+        }
+      } catch (const kj::Exception &e) {
+        break;  // the rest of the message isn't written yet
+      }
+    }
+    buf.erase(0, buf.size() - words.size() * sizeof(capnp::word));
+    return true;
+  }
+
+private:
+  std::string find_route() {
+    for (auto &[name, _] : util::read_files_in_dir(BENCH_LOG_ROOT)) {
+      if (name.size() > 3 && name.compare(name.size() - 3, 3, "--0") == 0) return name.substr(0, name.size() - 3);
+    }
+    return "";
+  }
+
+  void next_segment() {
+    const size_t pos = path.rfind("--");
+    const int segment = std::stoi(path.substr(pos + 2));
+    path = path.substr(0, pos) + "--" + std::to_string(segment + 1) + "/rlog";
+    offset = 0;
+    buf.clear();
+  }
+
+  std::string path;
+  size_t offset = 0;
+  std::string buf;
+};
+
+int main(int argc, char *argv[]) {
+  int seconds = 10;
+  double rate = 1.0;
+  bool direct = false;
+  const struct option opts[] = {
+    {"seconds", required_argument, nullptr, 's'},
+    {"rate", required_argument, nullptr, 'r'},
+    {"direct", no_argument, nullptr, 'd'},
+    {nullptr, 0, nullptr, 0},
+  };
+  for (int opt; (opt = getopt_long(argc, argv, "s:r:d", opts, nullptr)) != -1;) {
+    switch (opt) {
+      case 's': seconds = atoi(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'd': direct = true; break;
+      default:
+        fprintf(stderr, "usage: %s [--seconds N] [--rate X] [--direct]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  // headless on a PC: msgq, and logs that don't mix with the real ones
+  unsetenv("ZMQ");
+  if (!direct) unsetenv("LOGGERD_COMPRESSION");  // the rlog is followed as it's written
+  setenv("LOG_ROOT", BENCH_LOG_ROOT.c_str(), 1);
+  system(("rm -rf " + BENCH_LOG_ROOT).c_str());
+  util::create_directories(BENCH_LOG_ROOT, 0775);
+
+  // every logged service with a fixed frequency. encoder packets need encoderd's segment numbers, they're skipped
+  std::unique_ptr<Context> ctx(Context::create());
+  std::map<std::string, ServiceStats> stats;
+  std::vector<Publisher> publishers;
+  for (const auto &it : services) {
+    const std::string name = it.name;
+    if (!it.should_log || it.frequency <= 0 || name.find("EncodeData") != std::string::npos) continue;
+    if (capnp::Schema::from<cereal::Event>().findFieldByName(name) == nullptr) continue;
+
+    stats[name] = {};
+    publishers.push_back({.name = name, .interval_ms = 1000. / (it.frequency * rate), .next_ms = 0, .msg = build_msg(name)});
+    if (!direct) publishers.back().sock.reset(PubSocket::create(ctx.get(), it.name));
+  }
+
+  pid_t loggerd_pid = 0;
+  LoggerState logger = {};
+  if (direct) {
+    logger_init(&logger, true, log_compression_from_env());
+    logger_next(&logger, BENCH_LOG_ROOT.c_str(), nullptr, 0, nullptr);
+  } else {
+    const std::string loggerd = util::dir_name(util::readlink("/proc/self/exe")) + "/../loggerd";
+    loggerd_pid = fork();
+    if (loggerd_pid == 0) {
+      execl(loggerd.c_str(), "loggerd", nullptr);
+      perror("exec loggerd");
+      _exit(1);
+    }
+    util::sleep_for(1000);  // let loggerd subscribe
+  }
+
+  printf("%zu services at %.1fx their frequency for %d s, %s\n", publishers.size(), rate, seconds,
+         direct ? "logger_log() in-process" : "msgq -> loggerd");
+
+  RlogFollower follower;
+  std::vector<double> latency_ms;
+  const double start_ms = millis_since_boot(), end_ms = start_ms + seconds * 1000;
+  double last_update_ms = start_ms;
+  for (double now_ms = start_ms; now_ms < end_ms; now_ms = millis_since_boot()) {
+    double next_ms = end_ms;
+    for (auto &p : publishers) {
+      if (p.next_ms <= now_ms) {
+        p.next_ms = std::max(p.next_ms + p.interval_ms, now_ms);
+        p.msg->getRoot<cereal::Event>().setLogMonoTime(nanos_since_boot());
+        auto bytes = p.msg->toBytes();
+        if (direct) {
+          const double t = millis_since_boot();
+          logger_log(&logger, bytes.begin(), bytes.size(), true);
+          latency_ms.push_back(millis_since_boot() - t);
+          ++stats[p.name].logged;
+        } else {
+          p.sock->send((char *)bytes.begin(), bytes.size());
+        }
+        ++stats[p.name].sent;
+        stats[p.name].bytes += bytes.size();
+      }
+      next_ms = std::min(next_ms, p.next_ms);
+    }
+    if (!direct && now_ms - last_update_ms >= FOLLOW_INTERVAL_MS) {
+      follower.update(stats, latency_ms);
+      last_update_ms = now_ms;
+    }
+    if (!direct) next_ms = std::min(next_ms, last_update_ms + FOLLOW_INTERVAL_MS);
+    const double sleep_ms = next_ms - millis_since_boot();
+    if (sleep_ms >= 1) util::sleep_for((int)sleep_ms);
+  }
+  const double elapsed_s = (millis_since_boot() - start_ms) / 1000.;
+
+  if (direct) {
+    logger_close(&logger);
+  } else {
+    // wait for the last writes, then stop loggerd and read the rest of the route
+    util::sleep_for(2000);
+    follower.update(stats, latency_ms);
+    kill(loggerd_pid, SIGINT);
+    waitpid(loggerd_pid, nullptr, 0);
+    std::vector<double> ignored;
+    for (int i = 0; i < 1000 && follower.update(stats, ignored); ++i) {
+      util::sleep_for(10);
+    }
+  }
+
+  uint64_t sent = 0, logged = 0, bytes = 0;
+  std::vector<std::pair<uint64_t, std::string>> drops;
+  for (auto &[name, s] : stats) {
+    sent += s.sent;
+    logged += s.logged;
+    bytes += s.bytes;
+    if (s.sent > s.logged) drops.push_back({s.sent - s.logged, name});
+  }
+  std::sort(drops.rbegin(), drops.rend());
+
+  if (direct) {
+    printf("sent %" PRIu64 " msgs\n", sent);
+  } else {
+    printf("sent %" PRIu64 " msgs, logged %" PRIu64 ", dropped %" PRIu64 "\n", sent, logged, sent - logged);
+  }
+  printf("  %.0f msgs/s, %.2f MB/s\n", logged / elapsed_s, bytes / 1e6 / elapsed_s);
+  printf("  %s latency p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n", direct ? "logger_log()" : "publish to rlog",
+         percentile(latency_ms, 0.5), percentile(latency_ms, 0.9), percentile(latency_ms, 0.99), percentile(latency_ms, 1.0));
+  if (!direct) {
+    printf("  granularity: the rlog is read every %d ms, the log writer flushes every %zu KB or %d ms\n",
+           FOLLOW_INTERVAL_MS, WRITE_CHUNK_SIZE >> 10, WRITE_INTERVAL_MS);
+    for (int i = 0; i < std::min<int>(drops.size(), 10); ++i) {
+      printf("  dropped %" PRIu64 " %s\n", drops[i].first, drops[i].second.c_str());
+    }
+  }
+  return 0;
+}
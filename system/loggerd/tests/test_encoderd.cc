@@ -0,0 +1,186 @@
+#include <cinttypes>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "libyuv.h"
+#include "common/timing.h"
+#include "common/util.h"
+#include "system/loggerd/encoder/encoder_worker.h"
+#include "system/loggerd/encoder/ffmpeg_encoder.h"
+#include "system/loggerd/loggerd.h"
+
+const int FRAME_WIDTH = 1928, FRAME_HEIGHT = 1208;
+
+// synthetic NV12 frames, like the ones camerad shares over VisionIpc
+struct SyntheticFrames {
+  SyntheticFrames(int cnt) : bufs(cnt) {
+    const size_t stride = FRAME_WIDTH, uv_offset = stride * FRAME_HEIGHT;
+    for (int i = 0; i < cnt; ++i) {
+      bufs[i].allocate(uv_offset * 3 / 2);
+      bufs[i].init_yuv(FRAME_WIDTH, FRAME_HEIGHT, stride, uv_offset);
+      for (int y = 0; y < FRAME_HEIGHT * 3 / 2; ++y) {
+        memset(bufs[i].y + y * stride, (y + i * 8) & 0xff, stride);
+      }
+    }
+  }
+  ~SyntheticFrames() {
+    for (auto &b : bufs) b.free();
+  }
+
+  VisionBuf *get(uint32_t frame_id, VisionIpcBufExtra *extra) {
+    VisionBuf *buf = &bufs[frame_id % bufs.size()];
+    buf->set_frame_id(frame_id);
+    *extra = {.frame_id = frame_id, .timestamp_sof = nanos_since_boot(), .timestamp_eof = nanos_since_boot()};
+    return buf;
+  }
+
+  std::vector<VisionBuf> bufs;
+};
+
+std::vector<std::unique_ptr<EncoderWorker>> create_workers() {
+  std::vector<std::unique_ptr<EncoderWorker>> workers;
+  for (auto &info : road_camera_info.encoder_infos) {
+    auto encoder = std::make_unique<FfmpegEncoder>(info, FRAME_WIDTH, FRAME_HEIGHT);
+    workers.push_back(std::make_unique<EncoderWorker>(std::move(encoder), info.publish_name));
+  }
+  return workers;
+}
+
+// feeds frame_cnt frames at fps (as fast as possible if 0) to all workers like encoderd does
+void dispatch(std::vector<std::unique_ptr<EncoderWorker>> &workers, SyntheticFrames &frames, int frame_cnt, int fps) {
+  EncoderFramePool pool;
+  for (int i = 0; i < frame_cnt; ++i) {
+    VisionIpcBufExtra extra;
+    VisionBuf *buf = frames.get(i, &extra);
+    EncoderFrame *frame = nullptr;
+    while (!(frame = pool.get(workers.size()))) {
+      util::sleep_for(1);
+    }
+    frame->buf = buf;
+    frame->extra = extra;
+    frame->segment = 0;
+    frame->recv_tms = millis_since_boot();
+    for (auto &w : workers) w->push(frame);
+    if (fps > 0) util::sleep_for(1000 / fps);
+  }
+}
+
+// waits for the workers to handle every frame, returns the elapsed time in ms
+double wait_for_workers(std::vector<std::unique_ptr<EncoderWorker>> &workers, uint64_t frame_cnt, double start_ms) {
+  for (auto &w : workers) {
+    for (int i = 0; i < 10000; ++i) {
+      auto stats = w->stats();
+      if (stats.encoded + stats.dropped + stats.overwritten >= frame_cnt) break;
+      util::sleep_for(1);
+    }
+  }
+  return millis_since_boot() - start_ms;
+}
+
+// the two pass conversion FfmpegEncoder did before nv12_to_i420_scaled
+void nv12_to_i420_two_pass(const VisionBuf *buf, uint8_t *dst, int width, int height, std::vector<uint8_t> &convert_buf) {
+  const int in_width = buf->width, in_height = buf->height;
+  convert_buf.resize(in_width * in_height * 3 / 2);
+  uint8_t *cy = convert_buf.data();
+  uint8_t *cu = cy + in_width * in_height;
+  uint8_t *cv = cu + (in_width / 2) * (in_height / 2);
+  libyuv::NV12ToI420(buf->y, buf->stride, buf->uv, buf->stride,
+                     cy, in_width, cu, in_width / 2, cv, in_width / 2, in_width, in_height);
+  uint8_t *out_u = dst + width * height;
+  uint8_t *out_v = out_u + (width / 2) * (height / 2);
+  libyuv::I420Scale(cy, in_width, cu, in_width / 2, cv, in_width / 2, in_width, in_height,
+                    dst, width, out_u, width / 2, out_v, width / 2, width, height, libyuv::kFilterNone);
+}
+
+TEST_CASE("nv12_to_i420_scaled") {
+  SyntheticFrames frames(1);
+  VisionBuf *buf = &frames.bufs[0];
+  std::mt19937 rng(1234);
+  for (size_t i = 0; i < buf->len; ++i) ((uint8_t *)buf->addr)[i] = rng();
+
+  auto [width, height] = GENERATE(std::make_pair(526, 330), std::make_pair(964, 604), std::make_pair(1928, 1208));
+  std::vector<uint8_t> expected(width * height * 3 / 2), out(expected.size()), uv_scratch(width * height / 2), convert_buf;
+  nv12_to_i420_two_pass(buf, expected.data(), width, height, convert_buf);
+  nv12_to_i420_scaled(buf, out.data(), width, height, uv_scratch.data());
+  REQUIRE(out == expected);
+}
+
+TEST_CASE("EncoderWorker") {
+  SyntheticFrames frames(YUV_BUFFER_COUNT);
+  auto workers = create_workers();
+  const int frame_cnt = 20;
+  dispatch(workers, frames, frame_cnt, MAIN_FPS);
+  wait_for_workers(workers, frame_cnt, millis_since_boot());
+
+  for (auto &w : workers) {
+    auto stats = w->stats();
+    INFO("encoded " << stats.encoded << " dropped " << stats.dropped << " overwritten " << stats.overwritten);
+    REQUIRE(stats.encoded + stats.dropped + stats.overwritten == frame_cnt);
+    REQUIRE(stats.encoded > 0);
+    REQUIRE(stats.max_latency_ms >= stats.total_latency_ms / stats.encoded);
+  }
+}
+
+TEST_CASE("EncoderWorker benchmark", "[.][benchmark]") {
+  SyntheticFrames frames(YUV_BUFFER_COUNT);
+  const int frame_cnt = 100;
+
+  // every encoder of the road camera in one thread, like encoderd used to
+  std::vector<std::unique_ptr<FfmpegEncoder>> encoders;
+  for (auto &info : road_camera_info.encoder_infos) {
+    encoders.push_back(std::make_unique<FfmpegEncoder>(info, FRAME_WIDTH, FRAME_HEIGHT));
+    encoders.back()->encoder_open(NULL);
+  }
+  double start_ms = millis_since_boot();
+  for (int i = 0; i < frame_cnt; ++i) {
+    VisionIpcBufExtra extra;
+    VisionBuf *buf = frames.get(i, &extra);
+    for (auto &e : encoders) e->encode_frame(buf, &extra);
+  }
+  double serial_ms = millis_since_boot() - start_ms;
+  for (auto &e : encoders) e->encoder_close();
+
+  // one worker per encoder, a slow encoder drops frames instead of holding back the others
+  auto workers = create_workers();
+  start_ms = millis_since_boot();
+  dispatch(workers, frames, frame_cnt, 0);
+  double parallel_ms = wait_for_workers(workers, frame_cnt, start_ms);
+
+  printf("%d frames %dx%d\n", frame_cnt, FRAME_WIDTH, FRAME_HEIGHT);
+  printf("  serial: %.1f fps for every encoder\n", frame_cnt * 1000. / serial_ms);
+  for (int i = 0; i < workers.size(); ++i) {
+    auto stats = workers[i]->stats();
+    printf("  %s: %.1f fps, dropped %" PRIu64 " overwritten %" PRIu64 ", latency avg %.1f ms max %.1f ms\n",
+           road_camera_info.encoder_infos[i].publish_name, stats.encoded * 1000. / parallel_ms, stats.dropped,
+           stats.overwritten, stats.encoded ? stats.total_latency_ms / stats.encoded : 0., stats.max_latency_ms);
+  }
+}
+
+TEST_CASE("nv12_to_i420_scaled benchmark", "[.][benchmark]") {
+  SyntheticFrames frames(YUV_BUFFER_COUNT);
+  const int frame_cnt = 200;
+  const int width = qcam_encoder_info.frame_width, height = qcam_encoder_info.frame_height;
+  std::vector<uint8_t> out(width * height * 3 / 2), uv_scratch(width * height / 2), convert_buf;
+
+  double start_ms = millis_since_boot();
+  for (int i = 0; i < frame_cnt; ++i) {
+    nv12_to_i420_two_pass(&frames.bufs[i % frames.bufs.size()], out.data(), width, height, convert_buf);
+  }
+  double two_pass_ms = (millis_since_boot() - start_ms) / frame_cnt;
+
+  start_ms = millis_since_boot();
+  for (int i = 0; i < frame_cnt; ++i) {
+    nv12_to_i420_scaled(&frames.bufs[i % frames.bufs.size()], out.data(), width, height, uv_scratch.data());
+  }
+  double fused_ms = (millis_since_boot() - start_ms) / frame_cnt;
+
+  // the two pass version also writes a full resolution I420 frame and reads (parts of) it back
+  const double intermediate_mb = FRAME_WIDTH * FRAME_HEIGHT * 3 / 2 / 1e6;
+  printf("%dx%d -> %dx%d\n", FRAME_WIDTH, FRAME_HEIGHT, width, height);
+  printf("  two pass: %.3f ms/frame\n", two_pass_ms);
+  printf("  fused:    %.3f ms/frame, up to %.1f MB/frame (%.0f MB/s at %d fps) less memory traffic\n",
+         fused_ms, intermediate_mb * 2, intermediate_mb * 2 * MAIN_FPS, MAIN_FPS);
+}
@@ -1,28 +1,69 @@
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <climits>
 #include <condition_variable>
+#include <future>
 #include <sstream>
 #include <thread>
 #include <utility>
 
+#include <bzlib.h>
+#include <zstd.h>
+
 #include "catch2/catch.hpp"
 #include "cereal/messaging/messaging.h"
+#include "common/timing.h"
 #include "common/util.h"
 #include "system/loggerd/logger.h"
 #include "tools/replay/util.h"
 
 typedef cereal::Sentinel::SentinelType SentinelType;
 
-void verify_segment(const std::string &route_path, int segment, int max_segment, int required_event_cnt) {
+std::string decompress(const std::string &in, LogCompression compression) {
+  if (compression == LogCompression::NONE) return in;
+
+  std::string out;
+  if (compression == LogCompression::BZ2) {
+    int ret = BZ_OUTBUFF_FULL;
+    for (size_t size = in.size() * 10; ret == BZ_OUTBUFF_FULL; size *= 2) {
+      out.resize(size);
+      unsigned int out_size = size;
+      ret = BZ2_bzBuffToBuffDecompress(out.data(), &out_size, (char *)in.data(), in.size(), 0, 0);
+      out.resize(out_size);
+    }
+    REQUIRE(ret == BZ_OK);
+  } else {
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_inBuffer input = {.src = in.data(), .size = in.size(), .pos = 0};
+    char buf[1 << 16];
+    ZSTD_outBuffer output = {.dst = buf, .size = sizeof(buf), .pos = 0};
+    size_t ret = 0;
+    do {
+      output.pos = 0;
+      ret = ZSTD_decompressStream(dctx, &output, &input);
+      REQUIRE(!ZSTD_isError(ret));
+      out.append(buf, output.pos);
+    } while (ret != 0 && (input.pos < input.size || output.pos == sizeof(buf)));
+    ZSTD_freeDCtx(dctx);
+    REQUIRE(ret == 0);
+  }
+  return out;
+}
+
+void verify_segment(const std::string &route_path, int segment, int max_segment, int required_event_cnt,
+                    LogCompression compression = LogCompression::NONE) {
   const std::string segment_path = route_path + "--" + std::to_string(segment);
   SentinelType begin_sentinel = segment == 0 ? SentinelType::START_OF_ROUTE : SentinelType::START_OF_SEGMENT;
   SentinelType end_sentinel = segment == max_segment - 1 ? SentinelType::END_OF_ROUTE : SentinelType::END_OF_SEGMENT;
 
   REQUIRE(!util::file_exists(segment_path + "/rlog.lock"));
   for (const char *fn : {"/rlog", "/qlog"}) {
-    const std::string log_file = segment_path + fn;
-    std::string log = util::read_file(log_file);
+    const std::string log_file = segment_path + fn + log_compression_ext(compression);
+    std::string log = decompress(util::read_file(log_file), compression);
     REQUIRE(!log.empty());
     int event_cnt = 0, i = 0;
     kj::ArrayPtr<const capnp::word> words((capnp::word *)log.data(), log.size() / sizeof(capnp::word));
@@ -54,6 +95,14 @@ void verify_segment(const std::string &route_path, int segment, int max_segment,
       }
     }
     REQUIRE(event_cnt == required_event_cnt);
+
+    // the index counts every message, and the last one ends at the end of the log
+    LogIndex index;
+    REQUIRE(index.deserialize(util::read_file(segment_path + fn + ".idx")));
+    REQUIRE(index.count() == i);
+    REQUIRE(index.count({(uint16_t)cereal::Event::CLOCKS}) == event_cnt);
+    REQUIRE(index.services.at((uint16_t)cereal::Event::INIT_DATA).entries[0].offset == 0);
+    REQUIRE(index.services.at((uint16_t)cereal::Event::SENTINEL).end_offset == log.size());
   }
 }
 
@@ -138,10 +187,216 @@ TEST_CASE("logger") {
     do_exit = true;
     do_exit.signal = 1;
     logger_close(&logger, &do_exit);
-    REQUIRE(logger.cur_handle->refcnt == 0);
+    for (auto &h : logger.handles) REQUIRE(h.refcnt == 0);
 
     for (int i = 0; i < segment_cnt; ++i) {
       verify_segment(log_root + "/" + logger.route_name, i, segment_cnt, event_cnt[i]);
     }
   }
 }
+
+TEST_CASE("logger compression") {
+  const std::string log_root = "/tmp/test_logger_compression";
+  system(("rm " + log_root + " -rf").c_str());
+
+  auto compression = GENERATE(LogCompression::BZ2, LogCompression::ZSTD);
+  ExitHandler do_exit;
+  LoggerState logger = {};
+  logger_init(&logger, true, compression);
+
+  const int segment_cnt = 10, event_cnt = 10000;
+  for (int i = 0; i < segment_cnt; ++i) {
+    REQUIRE(logger_next(&logger, log_root.c_str(), nullptr, 0, nullptr) == 0);
+    for (int j = 0; j < event_cnt; ++j) {
+      write_msg(logger.cur_handle);
+    }
+  }
+  do_exit = true;
+  do_exit.signal = 1;
+  logger_close(&logger, &do_exit);
+  for (int i = 0; i < segment_cnt; ++i) {
+    verify_segment(log_root + "/" + logger.route_name, i, segment_cnt, event_cnt, compression);
+  }
+}
+
+TEST_CASE("logger initData not ready") {
+  const std::string log_root = "/tmp/test_logger_init_data";
+  system(("rm " + log_root + " -rf").c_str());
+
+  ExitHandler do_exit;
+  LoggerState logger = {};
+  logger_init(&logger, true);
+  // initData that's still being built when the route starts
+  std::promise<kj::Array<capnp::word>> init_data;
+  logger.init_data = init_data.get_future().share();
+
+  REQUIRE(logger_next(&logger, log_root.c_str(), nullptr, 0, nullptr) == 0);
+  MessageBuilder msg;
+  msg.initEvent().initClocks();
+  auto bytes = msg.toBytes();
+  const int event_cnt = 100;
+  for (int i = 0; i < event_cnt; ++i) {
+    if (i == event_cnt / 2) init_data.set_value(logger_build_init_data());
+    logger_log(&logger, bytes.begin(), bytes.size(), true);
+  }
+  do_exit = true;
+  do_exit.signal = 1;
+  logger_close(&logger, &do_exit);
+
+  // the messages logged before initData was ready are written after it and the sentinel
+  verify_segment(log_root + "/" + logger.route_name, 0, 1, event_cnt);
+}
+
+TEST_CASE("logger rotation under load") {
+  const std::string log_root = "/tmp/test_logger_rotation";
+  system(("rm " + log_root + " -rf").c_str());
+
+  ExitHandler do_exit;
+  LoggerState logger = {};
+  logger_init(&logger, true);
+  REQUIRE(logger_next(&logger, log_root.c_str(), nullptr, 0, nullptr) == 0);
+
+  // logger_log from many threads while the main thread rotates as fast as it can.
+  // logMonoTime is thread * 1e9 + seq, to check that no message is lost or reordered
+  const int thread_cnt = 8, segment_cnt = 50;
+  std::atomic<bool> stop = false;
+  std::atomic<int> sent[thread_cnt] = {};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_cnt; ++t) {
+    threads.emplace_back([&, t]() {
+      for (uint64_t seq = 0; !stop; ++seq) {
+        MessageBuilder msg;
+        msg.initEvent().initClocks();
+        msg.getRoot<cereal::Event>().setLogMonoTime(t * 1000000000ULL + seq);
+        auto bytes = msg.toBytes();
+        if (t % 2 == 0) {
+          logger_log(&logger, bytes.begin(), bytes.size(), true);
+        } else {
+          // some threads hold on to a handle for a few messages, like the encoder threads used to
+          LoggerHandle *h = logger_get_handle(&logger);
+          lh_log(h, bytes.begin(), bytes.size(), true);
+          lh_close(h);
+        }
+        ++sent[t];
+      }
+    });
+  }
+  for (int i = 1; i < segment_cnt; ++i) {
+    util::sleep_for(2);
+    REQUIRE(logger_next(&logger, log_root.c_str(), nullptr, 0, nullptr) == 0);
+  }
+  stop = true;
+  for (auto &t : threads) t.join();
+  do_exit = true;
+  do_exit.signal = 1;
+  logger_close(&logger, &do_exit);
+  for (auto &h : logger.handles) REQUIRE(h.refcnt == 0);
+
+  std::vector<uint64_t> next_seq(thread_cnt, 0);
+  for (int i = 0; i < segment_cnt; ++i) {
+    const std::string segment_path = log_root + "/" + logger.route_name + "--" + std::to_string(i);
+    std::string log = util::read_file(segment_path + "/rlog");
+    kj::ArrayPtr<const capnp::word> words((capnp::word *)log.data(), log.size() / sizeof(capnp::word));
+    int event_cnt = 0;
+    while (words.size() > 0) {
+      capnp::FlatArrayMessageReader reader(words);
+      auto event = reader.getRoot<cereal::Event>();
+      words = kj::arrayPtr(reader.getEnd(), words.end());
+      if (event.which() != cereal::Event::CLOCKS) continue;
+
+      const int t = event.getLogMonoTime() / 1000000000ULL;
+      REQUIRE(event.getLogMonoTime() % 1000000000ULL == next_seq[t]++);
+      ++event_cnt;
+    }
+    verify_segment(log_root + "/" + logger.route_name, i, segment_cnt, event_cnt);
+  }
+  for (int t = 0; t < thread_cnt; ++t) {
+    REQUIRE(next_seq[t] == sent[t]);
+  }
+}
+
+TEST_CASE("logger_build_init_data") {
+  auto init_data = logger_build_init_data();
+  capnp::FlatArrayMessageReader reader(init_data);
+  auto init = reader.getRoot<cereal::Event>().getInitData();
+  REQUIRE(init.getKernelArgs().size() > 0);
+
+  std::string df;
+  for (auto entry : init.getCommands().getEntries()) {
+    if (entry.getKey() == "df -h") {
+      df = std::string((const char *)entry.getValue().begin(), entry.getValue().size());
+    }
+  }
+  // disk usage of the root filesystem is always there
+  INFO(df);
+  REQUIRE(df.find("Filesystem Size Used Avail Use% Mounted on\n") == 0);
+  REQUIRE(df.find(" /\n") != std::string::npos);
+}
+
+// percentage of the file in the page cache
+double page_cache_residency(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat st = {};
+  fstat(fd, &st);
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) return 0;
+
+  const size_t page_size = sysconf(_SC_PAGESIZE), pages = (st.st_size + page_size - 1) / page_size;
+  std::vector<unsigned char> vec(pages);
+  mincore(addr, st.st_size, vec.data());
+  munmap(addr, st.st_size);
+  return 100.0 * std::count_if(vec.begin(), vec.end(), [](unsigned char v) { return v & 1; }) / pages;
+}
+
+TEST_CASE("logger benchmark", "[.][benchmark]") {
+  const std::string log_root = "/tmp/test_logger_benchmark";
+  system(("rm " + log_root + " -rf").c_str());
+
+  // about what loggerd sees on the road: 5000 msgs/s, mostly small messages and some large ones
+  const int segment_cnt = 3, segment_seconds = 5, msgs_per_sec = 5000, tick_ms = 10;
+  std::vector<kj::Array<capnp::word>> msgs;
+  for (int i = 0; i < 100; ++i) {
+    MessageBuilder msg;
+    msg.initEvent().setLogMessage(std::string(i == 0 ? 40000 : i < 10 ? 2000 : 200, 'a' + i % 26));
+    msgs.push_back(capnp::messageToFlatArray(msg));
+  }
+
+  LoggerState logger = {};
+  logger_init(&logger, true);
+  std::vector<double> log_us, rotate_ms;
+  size_t bytes = 0;
+  for (int seg = 0; seg < segment_cnt; ++seg) {
+    double start_ms = millis_since_boot();
+    REQUIRE(logger_next(&logger, log_root.c_str(), nullptr, 0, nullptr) == 0);
+    rotate_ms.push_back(millis_since_boot() - start_ms);
+
+    for (int tick = 0; tick < segment_seconds * 1000 / tick_ms; ++tick) {
+      double tick_start_ms = millis_since_boot();
+      for (int i = 0; i < msgs_per_sec * tick_ms / 1000; ++i) {
+        auto bytes_arr = msgs[(tick + i) % msgs.size()].asBytes();
+        double t = millis_since_boot();
+        logger_log(&logger, bytes_arr.begin(), bytes_arr.size(), i % 10 == 0);
+        log_us.push_back((millis_since_boot() - t) * 1000);
+        bytes += bytes_arr.size();
+      }
+      util::sleep_for(std::max(0, tick_ms - (int)(millis_since_boot() - tick_start_ms)));
+    }
+  }
+  double start_ms = millis_since_boot();
+  logger_close(&logger);
+  rotate_ms.push_back(millis_since_boot() - start_ms);
+
+  std::sort(log_us.begin(), log_us.end());
+  auto percentile = [&](double p) { return log_us[std::min(log_us.size() - 1, (size_t)(log_us.size() * p))]; };
+  printf("%zu msgs, %.1f MB/s\n", log_us.size(), bytes / 1e6 / (segment_cnt * segment_seconds));
+  printf("  logger_log: p50 %.1f us, p99 %.1f us, max %.1f us\n", percentile(0.5), percentile(0.99), log_us.back());
+  printf("  rotation: max %.1f ms\n", *std::max_element(rotate_ms.begin(), rotate_ms.end()));
+  for (int seg = 0; seg < segment_cnt; ++seg) {
+    const std::string rlog = log_root + "/" + logger.route_name + "--" + std::to_string(seg) + "/rlog";
+    struct stat st = {};
+    stat(rlog.c_str(), &st);
+    printf("  segment %d: %.1f MB, %.1f MB allocated, %.0f%% in page cache\n", seg, st.st_size / 1e6,
+           st.st_blocks * 512 / 1e6, page_cache_residency(rlog));
+  }
+}
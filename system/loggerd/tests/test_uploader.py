@@ -175,6 +175,18 @@ class TestUploader(UploaderTestCase):
 
     self.assertEqual(len(log_handler.upload_order), 0, "File uploaded again")
 
+  def test_no_upload_zst(self):
+    f_paths = [self.make_file_with_data(self.seg_dir, t, 1) for t in ["qlog.zst", "rlog.zst"]]
+
+    self.start_thread()
+    # allow enough time that files should have been uploaded if they would be uploaded
+    time.sleep(5)
+    self.join_thread()
+
+    self.assertEqual(len(log_handler.upload_order), 0, "zstd log uploaded")
+    for f_path in f_paths:
+      self.assertNotIn(UPLOAD_ATTR_NAME, os.listxattr(f_path), "zstd log marked as uploaded")
+
   def test_clear_locks_on_startup(self):
     f_paths = self.gen_files(lock=True, boot=False)
     self.start_thread()
@@ -111,6 +111,10 @@ class Uploader:
         continue
 
       for name in sorted(names, key=self.get_upload_sort):
+        # the server only takes bz2 logs, zstd logs (LOGGERD_COMPRESSION=zstd) are kept for local use
+        if name.endswith(".zst"):
+          continue
+
         key = os.path.join(logname, name)
         fn = os.path.join(path, name)
         # skip files already uploaded
@@ -1,4 +1,6 @@
 #!/usr/bin/env python3
+import json
+import struct
 import zmq
 from typing import NoReturn
 
@@ -6,6 +8,42 @@ import cereal.messaging as messaging
 from common.logging_extra import SwagLogFileFormatter
 from system.swaglog import get_file_handler
 
+# SwaglogRecordHeader in common/swaglog.h
+SWAGLOG_RECORD_HEADER = struct.Struct("<BBHiIIHHHxxdQ")
+SWAGLOG_TIMESTAMP = 0x1
+SWAGLOG_FRAME_ID = 0x2
+
+
+def decode_record(dat: bytes) -> str:
+  """Python records are already json, C++ ones are a binary header followed by the strings"""
+  if len(dat) < 2 or dat[1] != 0:
+    return dat[1:].decode("utf-8")
+
+  levelnum, _, flags, lineno, frame_id, msg_len, ctx_len, filename_len, funcname_len, created, timestamp = \
+    SWAGLOG_RECORD_HEADER.unpack_from(dat)
+  strings = []
+  offset = SWAGLOG_RECORD_HEADER.size
+  for length in (ctx_len, filename_len, funcname_len, msg_len):
+    strings.append(dat[offset:offset + length].decode("utf-8", "backslashreplace"))
+    offset += length
+  ctx, filename, funcname, msg = strings
+
+  if flags & SWAGLOG_TIMESTAMP:
+    event = {"event": msg, "time": str(timestamp)}
+    if flags & SWAGLOG_FRAME_ID:
+      event["frame_id"] = str(frame_id)
+    msg = {"timestamp": event}
+
+  return json.dumps({
+    "created": created,
+    "ctx": json.loads(ctx),
+    "filename": filename,
+    "funcname": funcname,
+    "levelnum": levelnum,
+    "lineno": lineno,
+    "msg": msg,
+  })
+
 
 def main() -> NoReturn:
   log_handler = get_file_handler()
@@ -24,7 +62,7 @@ def main() -> NoReturn:
     while True:
       dat = b''.join(sock.recv_multipart())
       level = dat[0]
-      record = dat[1:].decode("utf-8")
+      record = decode_record(dat)
       if level >= log_level:
         log_handler.emit(record)
 
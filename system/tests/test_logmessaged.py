@@ -1,5 +1,6 @@
 #!/usr/bin/env python3
 import glob
+import json
 import os
 import shutil
 import time
@@ -7,6 +8,7 @@ import unittest
 
 import cereal.messaging as messaging
 from selfdrive.manager.process_config import managed_processes
+from system.logmessaged import SWAGLOG_RECORD_HEADER, SWAGLOG_FRAME_ID, SWAGLOG_TIMESTAMP, decode_record
 from system.swaglog import cloudlog, SWAGLOG_DIR
 
 
@@ -56,5 +58,25 @@ class TestLogmessaged(unittest.TestCase):
     assert (n*len(msg)) < logsize < (n*(len(msg)+1024))
 
 
+class TestDecodeRecord(unittest.TestCase):
+  def _record(self, msg, flags=0, frame_id=0, timestamp=0):
+    ctx, filename, funcname = b'{"daemon": "loggerd"}', b"logger.cc", b"logger_init"
+    header = SWAGLOG_RECORD_HEADER.pack(40, 0, flags, 42, frame_id, len(msg), len(ctx), len(filename),
+                                        len(funcname), 1234.5, timestamp)
+    return header + ctx + filename + funcname + msg
+
+  def test_binary_record(self):
+    record = json.loads(decode_record(self._record(b"hello")))
+    assert record == {"created": 1234.5, "ctx": {"daemon": "loggerd"}, "filename": "logger.cc",
+                      "funcname": "logger_init", "levelnum": 40, "lineno": 42, "msg": "hello"}
+
+  def test_timestamp_record(self):
+    record = json.loads(decode_record(self._record(b"start", SWAGLOG_TIMESTAMP | SWAGLOG_FRAME_ID, 7, 123)))
+    assert record["msg"] == {"timestamp": {"event": "start", "frame_id": "7", "time": "123"}}
+
+  def test_json_record(self):
+    assert decode_record(chr(20).encode() + b'{"msg": "python"}') == '{"msg": "python"}'
+
+
 if __name__ == "__main__":
   unittest.main()
@@ -31,6 +31,7 @@ int main(int argc, char *argv[]) {
   cmd_parser.addOption({"zmq", "the ip address on which to receive zmq messages", "zmq"});
   cmd_parser.addOption({"data_dir", "local directory with routes", "data_dir"});
   cmd_parser.addOption({"no-vipc", "do not output video"});
+  cmd_parser.addOption({"decoded-cache", "keep decompressed logs in the local cache for faster reloads"});
   cmd_parser.addOption({"dbc", "dbc file to open", "dbc"});
   cmd_parser.process(app);
 
@@ -59,6 +60,9 @@ int main(int argc, char *argv[]) {
     } else if (cmd_parser.isSet("no-vipc")) {
       replay_flags |= REPLAY_FLAG_NO_VIPC;
     }
+    if (cmd_parser.isSet("decoded-cache")) {
+      replay_flags |= REPLAY_FLAG_DECODED_CACHE;
+    }
 
     const QStringList args = cmd_parser.positionalArguments();
     QString route;
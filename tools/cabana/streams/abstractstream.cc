@@ -131,7 +131,8 @@ void AbstractStream::mergeEvents(std::vector<Event *>::const_iterator first, std
   size_t events_cnt = 0;
   for (auto it = first; it != last; ++it) {
     if ((*it)->which == cereal::Event::Which::CAN) {
-      for (const auto &c : (*it)->event.getCan()) {
+      capnp::FlatArrayMessageReader reader((*it)->words);
+      for (const auto &c : reader.getRoot<cereal::Event>().getCan()) {
         memory_size += sizeof(CanEvent) + sizeof(uint8_t) * c.getDat().size();
         ++events_cnt;
       }
@@ -146,7 +147,8 @@ void AbstractStream::mergeEvents(std::vector<Event *>::const_iterator first, std
   for (auto it = first; it != last; ++it) {
     if ((*it)->which == cereal::Event::Which::CAN) {
       uint64_t ts = (*it)->mono_time;
-      for (const auto &c : (*it)->event.getCan()) {
+      capnp::FlatArrayMessageReader reader((*it)->words);
+      for (const auto &c : reader.getRoot<cereal::Event>().getCan()) {
         CanEvent *e = (CanEvent *)ptr;
         e->src = c.getSrc();
         e->address = c.getAddress();
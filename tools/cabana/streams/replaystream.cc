@@ -50,7 +50,8 @@ bool ReplayStream::eventFilter(const Event *event) {
   // delay posting CAN message if UI thread is busy
   if (event->which == cereal::Event::Which::CAN) {
     double current_sec = event->mono_time / 1e9 - routeStartTime();
-    for (const auto &c : event->event.getCan()) {
+    capnp::FlatArrayMessageReader reader(event->words);
+    for (const auto &c : reader.getRoot<cereal::Event>().getCan()) {
       MessageId id = {.source = c.getSrc(), .address = c.getAddress()};
       const auto dat = c.getDat();
       updateEvent(id, current_sec, (const uint8_t*)dat.begin(), dat.size());
@@ -40,8 +40,10 @@ TEST_CASE("Parse can messages") {
   REQUIRE(log.events.size() > 0);
   for (auto e : log.events) {
     if (e->which == cereal::Event::Which::CAN) {
+      capnp::FlatArrayMessageReader reader(e->words);
+      auto event = reader.getRoot<cereal::Event>();
       std::map<std::pair<uint32_t, QString>, std::vector<double>> values_1;
-      for (const auto &c : e->event.getCan()) {
+      for (const auto &c : event.getCan()) {
         const auto msg = dbc.msg({.source = c.getSrc(), .address = c.getAddress()});
         if (c.getSrc() == 0 && msg) {
           for (auto sig : msg->getSignals()) {
@@ -51,7 +53,7 @@ TEST_CASE("Parse can messages") {
         }
       }
 
-      can_parser.UpdateCans(e->mono_time, e->event.getCan());
+      can_parser.UpdateCans(e->mono_time, event.getCan());
       std::vector<SignalValue> values_2;
       can_parser.query_latest(values_2);
       for (auto &[key, v1] : values_1) {
@@ -194,8 +194,10 @@ void Slider::parseQLog() {
         emit updateMaximumTime(max_time);
       }
       for (auto ev = log.events.cbegin(); ev != log.events.cend() && !abort_parse_qlog; ++ev) {
+        capnp::FlatArrayMessageReader reader((*ev)->words);
+        auto event = reader.getRoot<cereal::Event>();
         if ((*ev)->which == cereal::Event::Which::THUMBNAIL) {
-          auto thumb = (*ev)->event.getThumbnail();
+          auto thumb = event.getThumbnail();
           auto data = thumb.getThumbnail();
           if (QPixmap pm; pm.loadFromData(data.begin(), data.size(), "jpeg")) {
             pm = pm.scaledToHeight(MIN_VIDEO_HEIGHT - THUMBNAIL_MARGIN * 2, Qt::SmoothTransformation);
@@ -203,7 +205,7 @@ void Slider::parseQLog() {
             thumbnails[thumb.getTimestampEof()] = pm;
           }
         } else if ((*ev)->which == cereal::Event::Which::CONTROLS_STATE) {
-          auto cs = (*ev)->event.getControlsState();
+          auto cs = event.getControlsState();
           if (cs.getAlertType().size() > 0 && cs.getAlertText1().size() > 0 &&
               cs.getAlertSize() != cereal::ControlsState::AlertSize::NONE) {
             std::lock_guard lk(thumbnail_lock);
@@ -43,27 +43,27 @@ void CameraServer::cameraThread(Camera &cam) {
   };
 
   while (true) {
-    const auto [fr, eidx] = cam.queue.pop();
-    if (!fr) break;
+    const Frame frame = cam.queue.pop();
+    if (!frame.fr) break;
 
-    const int id = eidx.getSegmentId();
-    bool prefetched = (id == cam.cached_id && eidx.getSegmentNum() == cam.cached_seg);
-    auto yuv = prefetched ? cam.cached_buf : read_frame(fr, id);
+    const int id = frame.segment_id;
+    bool prefetched = (id == cam.cached_id && frame.segment_num == cam.cached_seg);
+    auto yuv = prefetched ? cam.cached_buf : read_frame(frame.fr, id);
     if (yuv) {
       VisionIpcBufExtra extra = {
-          .frame_id = eidx.getFrameId(),
-          .timestamp_sof = eidx.getTimestampSof(),
-          .timestamp_eof = eidx.getTimestampEof(),
+          .frame_id = frame.frame_id,
+          .timestamp_sof = frame.timestamp_sof,
+          .timestamp_eof = frame.timestamp_eof,
       };
-      yuv->set_frame_id(eidx.getFrameId());
+      yuv->set_frame_id(frame.frame_id);
       vipc_server_->send(yuv, &extra);
     } else {
-      rError("camera[%d] failed to get frame: %lu", cam.type, eidx.getSegmentId());
+      rError("camera[%d] failed to get frame: %u", cam.type, frame.segment_id);
     }
 
     cam.cached_id = id + 1;
-    cam.cached_seg = eidx.getSegmentNum();
-    cam.cached_buf = read_frame(fr, cam.cached_id);
+    cam.cached_seg = frame.segment_num;
+    cam.cached_buf = read_frame(frame.fr, cam.cached_id);
 
     --publishing_;
   }
@@ -79,7 +79,14 @@ void CameraServer::pushFrame(CameraType type, FrameReader *fr, const cereal::Enc
   }
 
   ++publishing_;
-  cam.queue.push({fr, eidx});
+  cam.queue.push({
+      .fr = fr,
+      .segment_id = eidx.getSegmentId(),
+      .segment_num = eidx.getSegmentNum(),
+      .frame_id = eidx.getFrameId(),
+      .timestamp_sof = eidx.getTimestampSof(),
+      .timestamp_eof = eidx.getTimestampEof(),
+  });
 }
 
 void CameraServer::waitForSent() {
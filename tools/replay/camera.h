@@ -6,6 +6,11 @@
 #include "tools/replay/framereader.h"
 #include "tools/replay/logreader.h"
 
+// frames queued per camera, 0.8s of video at 20fps. pushFrame() blocks once a camera is this far behind.
+// that only paces the stream thread to the decoder: cameraThread() never waits on the stream thread,
+// and the stream thread already waits for every queued frame in waitForSent() before it unlocks.
+const int CAMERA_QUEUE_SIZE = 16;
+
 class CameraServer {
 public:
   CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS] = nullptr);
@@ -14,13 +19,22 @@ public:
   void waitForSent();
 
 protected:
+  // what cameraThread() needs of the EncodeIndex, the message reader is gone by the time it runs
+  struct Frame {
+    FrameReader *fr = nullptr;
+    uint32_t segment_id = 0;
+    int32_t segment_num = 0;
+    uint32_t frame_id = 0;
+    uint64_t timestamp_sof = 0;
+    uint64_t timestamp_eof = 0;
+  };
   struct Camera {
     CameraType type;
     VisionStreamType stream_type;
     int width;
     int height;
     std::thread thread;
-    SafeQueue<std::pair<FrameReader*, const cereal::EncodeIndex::Reader>> queue;
+    RingQueue<Frame, CAMERA_QUEUE_SIZE> queue;
     int cached_id = -1;
     int cached_seg = -1;
     VisionBuf * cached_buf;
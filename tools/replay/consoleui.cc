@@ -106,7 +106,7 @@ void ConsoleUI::initWindows() {
   w[Win::Stats] = newwin(2, max_width - 2 * BORDER_SIZE, 2, BORDER_SIZE);
   w[Win::Timeline] = newwin(4, max_width - 2 * BORDER_SIZE, 5, BORDER_SIZE);
   w[Win::TimelineDesc] = newwin(1, 100, 10, BORDER_SIZE);
-  w[Win::CarState] = newwin(3, 100, 12, BORDER_SIZE);
+  w[Win::CarState] = newwin(4, 100, 12, BORDER_SIZE);
   w[Win::DownloadBar] = newwin(1, 100, 16, BORDER_SIZE);
   if (int log_height = max_height - 27; log_height > 4) {
     w[Win::LogBorder] = newwin(log_height, max_width - 2 * (BORDER_SIZE - 1), 17, BORDER_SIZE - 1);
@@ -182,6 +182,12 @@ void ConsoleUI::updateStatus() {
   auto angle_offsets = util::string_format("%.2f|%.2f", p.getAngleOffsetAverageDeg(), p.getAngleOffsetDeg());
   write_item(2, 25, "ANGLE OFFSET(AVG|INSTANT): ", angle_offsets, " deg");
 
+  auto cache = replay->cacheStats();
+  const size_t limit = replay->cacheMemoryLimit();
+  auto cache_str = util::string_format("%d segments, %s", cache.loaded, formattedDataSize(cache.memory).c_str());
+  auto cache_unit = util::string_format("%s, %d loading   ", limit > 0 ? (" / " + formattedDataSize(limit)).c_str() : "", cache.loading);
+  write_item(3, 0, "CACHE:     ", cache_str, cache_unit);
+
   wrefresh(w[Win::CarState]);
 }
 
@@ -177,6 +177,14 @@ bool FrameReader::initHardwareDecoder(AVHWDeviceType hw_device_type) {
   return true;
 }
 
+size_t FrameReader::memoryUsage() const {
+  size_t size = packets.capacity() * sizeof(AVPacket *);
+  for (const AVPacket *pkt : packets) {
+    size += sizeof(AVPacket) + pkt->size + AV_INPUT_BUFFER_PADDING_SIZE;
+  }
+  return size;
+}
+
 bool FrameReader::get(int idx, uint8_t *yuv) {
   assert(yuv != nullptr);
   if (!valid_ || idx < 0 || idx >= packets.size()) {
@@ -25,6 +25,8 @@ public:
   bool get(int idx, uint8_t *yuv);
   int getYUVSize() const { return width * height * 3 / 2; }
   size_t getFrameCount() const { return packets.size(); }
+  // bytes held by the demuxed packets
+  size_t memoryUsage() const;
   bool valid() const { return valid_; }
 
   int width = 0, height = 0;
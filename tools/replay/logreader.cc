@@ -1,11 +1,54 @@
 #include "tools/replay/logreader.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include <capnp/schema.h>
+
+#include "common/util.h"
 #include "tools/replay/util.h"
 
-Event::Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame) : reader(amsg), frame(frame) {
+// reads which() and logMonoTime of the Event in msg straight from its words, without a MessageReader. false if the root struct isn't where loggerd puts it, in the first segment.
+static bool peekEvent(kj::ArrayPtr<const capnp::word> msg, cereal::Event::Which &which, uint64_t &mono_time) {
+  static const uint32_t discriminant_offset = capnp::Schema::from<cereal::Event>().getProto().getStruct().getDiscriminantOffset();
+
+  // segment table: the segment count - 1, the segments' sizes, padded to a word
+  const uint32_t *table = (const uint32_t *)msg.begin();
+  const size_t table_words = (table[0] + 3) / 2;
+  if (table[0] >= msg.size() * 2 || table_words >= msg.size() || table[1] == 0) return false;
+
+  // the root struct pointer: kind in bit 0-1, offset in words in bit 2-31, data section size in words in bit 32-47
+  const capnp::word *segment = msg.begin() + table_words;
+  uint64_t ptr = 0;
+  memcpy(&ptr, segment, sizeof(ptr));
+  const int64_t offset = (int32_t)(ptr & 0xffffffff) >> 2;
+  const size_t data_words = (ptr >> 32) & 0xffff;
+  if ((ptr & 3) != 0 || offset < 0 || 1 + offset + data_words > std::min<size_t>(table[1], msg.size() - table_words)) return false;
+
+  // fields outside of the data section (written by an older schema) have their default value 0
+  const uint8_t *data = (const uint8_t *)(segment + 1 + offset);
+  uint16_t discriminant = 0;
+  mono_time = 0;
+  if (data_words >= 1) memcpy(&mono_time, data, sizeof(mono_time));
+  if ((discriminant_offset + 1) * 2 <= data_words * sizeof(capnp::word)) {
+    memcpy(&discriminant, data + discriminant_offset * 2, sizeof(discriminant));
+  }
+  which = (cereal::Event::Which)discriminant;
+  return true;
+}
+
+Event::Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame) : words(amsg), frame(frame) {
+  if (!frame && peekEvent(amsg, which, mono_time)) return;
+
+  capnp::FlatArrayMessageReader reader(amsg);
   words = kj::ArrayPtr<const capnp::word>(amsg.begin(), reader.getEnd());
-  event = reader.getRoot<cereal::Event>();
+  auto event = reader.getRoot<cereal::Event>();
   which = event.which();
   mono_time = event.getLogMonoTime();
 
@@ -26,10 +69,44 @@ Event::Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame) : reader(a
 
 // class LogReader
 
+// decompressed logs are kept in blocks of LOG_BLOCK_SIZE, and parsed LOG_CHUNK_SIZE at a time
+const size_t LOG_BLOCK_SIZE = 8 * 1024 * 1024;
+const size_t LOG_CHUNK_SIZE = 1024 * 1024;
+
+// the decoded cache of a compressed log is a header, the index of its sorted events and
+// the decompressed log. it's mapped as it is.
+const char DECODED_CACHE_MAGIC[4] = {'R', 'L', 'D', 'C'};
+const uint16_t DECODED_CACHE_VERSION = 1;
+
+struct DecodedCacheHeader {
+  char magic[4];
+  uint16_t version;
+  uint16_t reserved;
+  // size and mtime of a local log, 0 for downloads, their urls always have the same content
+  uint64_t source_size;
+  uint64_t source_mtime;
+  uint64_t event_cnt;
+  uint64_t data_words;
+};
+
+struct DecodedCacheEntry {
+  uint64_t mono_time;
+  uint64_t offset;  // in words, into the decompressed log
+  uint32_t size;    // in words
+  uint16_t which;
+  uint8_t frame;
+  uint8_t reserved;
+};
+
+std::string decodedCachePath(const std::string &url) {
+  return cacheFilePath(url) + ".decoded";
+}
+
 LogReader::LogReader(size_t memory_pool_block_size) {
 #ifdef HAS_MEMORY_RESOURCE
   const size_t buf_size = sizeof(Event) * memory_pool_block_size;
   pool_buffer_ = ::operator new(buf_size);
+  pool_size_ = buf_size;
   mbr_ = new std::pmr::monotonic_buffer_resource(pool_buffer_, buf_size);
 #endif
   events.reserve(memory_pool_block_size);
@@ -44,65 +121,382 @@ LogReader::~LogReader() {
   delete mbr_;
   ::operator delete(pool_buffer_);
 #endif
+  if (mmap_) {
+    munmap(mmap_, mmap_size_);
+  }
+}
+
+size_t LogReader::memoryUsage() const {
+  size_t size = raw_.capacity() + blocks_size_ + mmap_size_ + events.capacity() * sizeof(Event *);
+#ifdef HAS_MEMORY_RESOURCE
+  // events that don't fit in the pool buffer are allocated from the heap
+  size += std::max(pool_size_, events.size() * sizeof(Event));
+#else
+  size += events.size() * sizeof(Event);
+#endif
+  return size;
 }
 
 bool LogReader::load(const std::string &url, std::atomic<bool> *abort,
                      const std::set<cereal::Event::Which> &allow,
                      bool local_cache, int chunk_size, int retries) {
-  raw_ = FileReader(local_cache, chunk_size, retries).read(url, abort);
-  if (raw_.empty()) return false;
+  // local logs written by loggerd have a seek index, only the part of the log
+  // that holds the allowed services in the time range has to be parsed
+  const bool is_remote = url.find("https://") == 0;
+  const bool compressed = url.find(".bz2") != std::string::npos || url.find(".zst") != std::string::npos;
+  std::pair<uint64_t, uint64_t> range = {0, std::string::npos};
+  LogIndex index;
+  if (!is_remote && index.deserialize(util::read_file(log_index_path(url)))) {
+    std::set<uint16_t> services;
+    for (auto which : allow) services.insert((uint16_t)which);
+    range = index.range(services, begin_mono_time_, end_mono_time_);
+    if (range.first == range.second) return false;
+    events.reserve(index.count(services));
+  }
 
-  if (url.find(".bz2") != std::string::npos) {
-    raw_ = decompressBZ2(raw_, abort);
+  if (compressed && decoded_cache_ && local_cache) {
+    // the cache holds the whole log, allow and the time range are applied to its index
+    uint64_t source_size = 0, source_mtime = 0;
+    if (struct stat st = {}; !is_remote && stat(url.c_str(), &st) == 0) {
+      source_size = st.st_size;
+      source_mtime = st.st_mtime;
+    }
+    if (loadDecodedCache(decodedCachePath(url), allow, source_size, source_mtime)) {
+      return !events.empty() && !(abort && *abort);
+    }
+
+    // the whole log is decompressed into blocks_ anyway, all of its messages are indexed while it's parsed
+    std::vector<Event> cache_index;
+    decoded_index_ = &cache_index;
+    bool ret = loadCompressed(url, abort, allow, local_cache, chunk_size, retries, {0, std::string::npos});
+    decoded_index_ = nullptr;
+    if (!cache_index.empty() && !(abort && *abort)) {
+      writeDecodedCache(url, cache_index, source_size, source_mtime);
+    }
+    return ret;
+  }
+  if (compressed) {
+    return loadCompressed(url, abort, allow, local_cache, chunk_size, retries, range);
+  }
+
+  // local (and cached) logs are mapped, events point into the file
+  const std::string local_file = is_remote ? cacheFilePath(url) : url;
+  kj::ArrayPtr<const capnp::word> data;
+  if ((!is_remote || local_cache) && util::file_exists(local_file) && mapFile(local_file)) {
+    data = kj::ArrayPtr<const capnp::word>((const capnp::word *)mmap_, mmap_size_ / sizeof(capnp::word));
+  } else {
+    raw_ = FileReader(local_cache, chunk_size, retries).read(url, abort);
     if (raw_.empty()) return false;
+    data = kj::ArrayPtr<const capnp::word>((const capnp::word *)raw_.data(), raw_.size() / sizeof(capnp::word));
   }
-  return parse(allow, abort);
+  return parse(data, allow, abort, range.first, range.second);
 }
 
-bool LogReader::load(const std::byte *data, size_t size, std::atomic<bool> *abort) {
-  raw_.assign((const char *)data, size);
-  return parse({}, abort);
-}
+bool LogReader::loadDecodedCache(const std::string &file, const std::set<cereal::Event::Which> &allow,
+                                 uint64_t source_size, uint64_t source_mtime) {
+  if (!util::file_exists(file) || !mapFile(file)) return false;
 
-bool LogReader::parse(const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort) {
-  try {
-    kj::ArrayPtr<const capnp::word> words((const capnp::word *)raw_.data(), raw_.size() / sizeof(capnp::word));
-    while (words.size() > 0 && !(abort && *abort)) {
+  const auto *header = (const DecodedCacheHeader *)mmap_;
+  const auto *entries = (const DecodedCacheEntry *)(header + 1);
+  const size_t max_entries = (mmap_size_ - std::min(mmap_size_, sizeof(DecodedCacheHeader))) / sizeof(DecodedCacheEntry);
+  bool valid = mmap_size_ >= sizeof(DecodedCacheHeader) && memcmp(header->magic, DECODED_CACHE_MAGIC, sizeof(DECODED_CACHE_MAGIC)) == 0 &&
+               header->version == DECODED_CACHE_VERSION && header->event_cnt <= max_entries &&
+               header->data_words == (mmap_size_ - sizeof(DecodedCacheHeader) - header->event_cnt * sizeof(DecodedCacheEntry)) / sizeof(capnp::word);
+  if (valid && (header->source_size != source_size || header->source_mtime != source_mtime)) {
+    rDebug("decoded cache %s is outdated", file.c_str());
+    munmap(mmap_, mmap_size_);
+    mmap_ = nullptr;
+    return false;
+  }
+
+  const capnp::word *data = valid ? (const capnp::word *)(entries + header->event_cnt) : nullptr;
+  for (size_t i = 0; valid && i < header->event_cnt; ++i) {
+    const DecodedCacheEntry &e = entries[i];
+    valid = e.size > 0 && e.offset < header->data_words && e.size <= header->data_words - e.offset;
+    if (!valid) break;
+
+    kj::ArrayPtr<const capnp::word> words(data + e.offset, e.size);
+    valid = capnp::expectedSizeInWordsFromPrefix(words) == e.size;
+    const auto which = (cereal::Event::Which)e.which;
+    if (!valid || (!allow.empty() && allow.find(which) == allow.end()) ||
+        e.mono_time < begin_mono_time_ || e.mono_time > end_mono_time_) {
+      continue;
+    }
 #ifdef HAS_MEMORY_RESOURCE
-      Event *evt = new (mbr_) Event(words);
+    events.push_back(new (mbr_) Event(which, e.mono_time, words, e.frame));
 #else
-      Event *evt = new Event(words);
+    events.push_back(new Event(which, e.mono_time, words, e.frame));
 #endif
-      if (!allow.empty() && allow.find(evt->which) == allow.end()) {
-        words = kj::arrayPtr(evt->reader.getEnd(), words.end());
-        delete evt;
-        continue;
+  }
+
+  if (!valid) {
+    rWarning("decoded cache %s is corrupt", file.c_str());
+    for (Event *e : events) {
+      delete e;
+    }
+    events.clear();
+    munmap(mmap_, mmap_size_);
+    mmap_ = nullptr;
+  }
+  return valid;
+}
+
+bool LogReader::writeDecodedCache(const std::string &url, const std::vector<Event> &index, uint64_t source_size, uint64_t source_mtime) {
+  // messages are written in log order, a frame event shares the message of the encodeIdx event before it
+  std::vector<DecodedCacheEntry> entries;
+  entries.reserve(index.size());
+  uint64_t data_words = 0;
+  for (const Event &e : index) {
+    if (!e.frame) data_words += e.words.size();
+    entries.push_back({
+      .mono_time = e.mono_time,
+      .offset = data_words - e.words.size(),
+      .size = (uint32_t)e.words.size(),
+      .which = (uint16_t)e.which,
+      .frame = e.frame,
+    });
+  }
+  std::sort(entries.begin(), entries.end(), [](const DecodedCacheEntry &l, const DecodedCacheEntry &r) {
+    return l.mono_time < r.mono_time || (l.mono_time == r.mono_time && l.which < r.which);
+  });
+
+  DecodedCacheHeader header = {
+    .version = DECODED_CACHE_VERSION,
+    .source_size = source_size,
+    .source_mtime = source_mtime,
+    .event_cnt = entries.size(),
+    .data_words = data_words,
+  };
+  memcpy(header.magic, DECODED_CACHE_MAGIC, sizeof(DECODED_CACHE_MAGIC));
+
+  // written to a temporary file first, so a cache is never seen half written
+  const std::string file = decodedCachePath(url);
+  std::string tmp_file = file + ".XXXXXX";
+  int fd = mkstemp(tmp_file.data());
+  if (fd < 0) return false;
+  close(fd);
+  std::ofstream f(tmp_file, std::ios::binary);
+  f.write((const char *)&header, sizeof(header));
+  f.write((const char *)entries.data(), entries.size() * sizeof(DecodedCacheEntry));
+  for (const Event &e : index) {
+    if (!e.frame) f.write((const char *)e.words.begin(), e.words.size() * sizeof(capnp::word));
+  }
+  f.close();
+  if (!f || rename(tmp_file.c_str(), file.c_str()) != 0) {
+    rWarning("failed to write decoded cache %s", file.c_str());
+    unlink(tmp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool LogReader::mapFile(const std::string &file) {
+  int fd = HANDLE_EINTR(open(file.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) return false;
+
+  struct stat st = {};
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      mmap_ = addr;
+      mmap_size_ = st.st_size;
+    }
+  }
+  close(fd);
+  return mmap_ != nullptr;
+}
+
+bool LogReader::loadCompressed(const std::string &url, std::atomic<bool> *abort, const std::set<cereal::Event::Which> &allow,
+                               bool local_cache, int chunk_size, int retries, std::pair<uint64_t, uint64_t> range) {
+  capnp::word *block = nullptr;
+  size_t block_words = 0;
+  size_t used = 0;    // decompressed bytes in block
+  size_t parsed = 0;  // words of block that were parsed
+  uint64_t offset = 0;
+  bool corrupt = false;
+  // parses the decompressed log as it comes in, returns false once the rest isn't needed
+  auto parse_chunk = [&](const char *data, size_t size) {
+    while (size > 0 && offset < range.second && !(abort && *abort)) {
+      if (used == block_words * sizeof(capnp::word)) {
+        // continue in a new block with the incomplete message at the end of the full one
+        const size_t rest = block_words - parsed;
+        const size_t words = std::max(LOG_BLOCK_SIZE / sizeof(capnp::word), rest * 2);
+        std::unique_ptr<capnp::word[]> next(new capnp::word[words]);
+        if (rest > 0) memcpy(next.get(), block + parsed, rest * sizeof(capnp::word));
+        if (block && parsed == 0) {
+          // no event points into it
+          blocks_.pop_back();
+          blocks_size_ -= block_words * sizeof(capnp::word);
+        }
+        blocks_.push_back(std::move(next));
+        blocks_size_ += words * sizeof(capnp::word);
+        block = blocks_.back().get();
+        block_words = words;
+        used = rest * sizeof(capnp::word);
+        parsed = 0;
       }
 
-      // Add encodeIdx packet again as a frame packet for the video stream
-      if (evt->which == cereal::Event::ROAD_ENCODE_IDX ||
-          evt->which == cereal::Event::DRIVER_ENCODE_IDX ||
-          evt->which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
+      const size_t n = std::min({size, LOG_CHUNK_SIZE, block_words * sizeof(capnp::word) - used});
+      memcpy((char *)block + used, data, n);
+      used += n;
+      data += n;
+      size -= n;
 
-#ifdef HAS_MEMORY_RESOURCE
-        Event *frame_evt = new (mbr_) Event(words, true);
-#else
-        Event *frame_evt = new Event(words, true);
-#endif
+      const size_t first = events.size();
+      try {
+        kj::ArrayPtr<const capnp::word> words(block + parsed, used / sizeof(capnp::word) - parsed);
+        parsed = parseMessages(words, allow, abort, offset, range).begin() - block;
+      } catch (const kj::Exception &e) {
+        rWarning("failed to parse log : %s", e.getDescription().cStr());
+        corrupt = true;
+      }
+      if (chunk_callback_ && events.size() > first) {
+        chunk_callback_(events, first);
+      }
+      if (corrupt) return false;
+    }
+    return offset < range.second && !(abort && *abort);
+  };
 
-        events.push_back(frame_evt);
+  // the blocks of bz2 files are decoded in parallel, which needs the whole file. local (and cached)
+  // zstd files are read a chunk at a time.
+  const bool is_remote = url.find("https://") == 0;
+  const bool bz2 = url.find(".bz2") != std::string::npos;
+  const std::string local_file = is_remote ? cacheFilePath(url) : url;
+  std::ifstream file;
+  std::string input;
+  if (!bz2 && (!is_remote || local_cache) && util::file_exists(local_file)) {
+    file.open(local_file, std::ios::binary);
+  } else {
+    input = FileReader(local_cache, chunk_size, retries).read(url, abort);
+    if (input.empty()) return false;
+  }
+
+  if (bz2) {
+    if (!decompressBZ2Parallel((const std::byte *)input.data(), input.size(), parse_chunk, abort)) corrupt = true;
+  } else {
+    StreamDecompressor decompressor(StreamDecompressor::Type::ZST);
+    const std::byte *in = (const std::byte *)input.data();
+    size_t in_size = input.size();
+    std::string out(LOG_CHUNK_SIZE, '\0');
+    while (!decompressor.finished() && !(abort && *abort)) {
+      if (in_size == 0 && file.is_open()) {
+        input.resize(LOG_CHUNK_SIZE);
+        file.read(input.data(), input.size());
+        in = (const std::byte *)input.data();
+        in_size = file.gcount();
+      }
+      const size_t prev_in_size = in_size;
+      ssize_t n = decompressor.decompress(&in, &in_size, (std::byte *)out.data(), out.size());
+      if (n < 0 || (n == 0 && in_size == prev_in_size && !decompressor.finished())) {
+        if (n == 0) rWarning("failed to parse log : content is truncated");
+        corrupt = true;
+        break;
       }
+      if (!parse_chunk(out.data(), n)) break;
+    }
+  }
+
+  if (corrupt && !events.empty()) {
+    rWarning("read %zu events from corrupt log", events.size());
+  }
+  return sortEvents(abort);
+}
+
+bool LogReader::load(const std::byte *data, size_t size, std::atomic<bool> *abort,
+                     const std::set<cereal::Event::Which> &allow) {
+  raw_.assign((const char *)data, size);
+  return parse(kj::ArrayPtr<const capnp::word>((const capnp::word *)raw_.data(), raw_.size() / sizeof(capnp::word)), allow, abort);
+}
 
-      words = kj::arrayPtr(evt->reader.getEnd(), words.end());
-      events.push_back(evt);
+bool LogReader::parse(kj::ArrayPtr<const capnp::word> data, const std::set<cereal::Event::Which> &allow,
+                      std::atomic<bool> *abort, size_t begin, size_t end) {
+  bool corrupt = false;
+  try {
+    uint64_t offset = 0;
+    if (parseMessages(data, allow, abort, offset, {begin, end}).size() > 0 && offset < end && !(abort && *abort)) {
+      corrupt = true;
+      rWarning("failed to parse log : content is truncated");
     }
   } catch (const kj::Exception &e) {
+    corrupt = true;
     rWarning("failed to parse log : %s", e.getDescription().cStr());
-    if (!events.empty()) {
-      rWarning("read %zu events from corrupt log", events.size());
+  }
+
+  if (corrupt && !events.empty()) {
+    rWarning("read %zu events from corrupt log", events.size());
+  }
+  return sortEvents(abort);
+}
+
+kj::ArrayPtr<const capnp::word> LogReader::parseMessages(kj::ArrayPtr<const capnp::word> words, const std::set<cereal::Event::Which> &allow,
+                                                         std::atomic<bool> *abort, uint64_t &offset, std::pair<uint64_t, uint64_t> range) {
+  while (words.size() > 0 && offset < range.second && !(abort && *abort)) {
+    const size_t size = capnp::expectedSizeInWordsFromPrefix(words);
+    if (size > words.size()) break;  // the message isn't complete
+
+    const uint64_t msg_offset = offset;
+    auto msg = words.slice(0, size);
+    words = words.slice(size, words.size());
+    offset += size * sizeof(capnp::word);
+    if (msg_offset < range.first) continue;
+
+    cereal::Event::Which which;
+    uint64_t mono_time = 0;
+    const bool peeked = peekEvent(msg, which, mono_time);
+    if (decoded_index_) {
+      indexMessage(msg, peeked, which, mono_time);
+    }
+    if (peeked &&
+        ((!allow.empty() && allow.find(which) == allow.end()) ||
+         mono_time < begin_mono_time_ || mono_time > end_mono_time_)) {
+      continue;
+    }
+
+#ifdef HAS_MEMORY_RESOURCE
+    Event *evt = new (mbr_) Event(msg);
+#else
+    Event *evt = new Event(msg);
+#endif
+    if ((!allow.empty() && allow.find(evt->which) == allow.end()) ||
+        evt->mono_time < begin_mono_time_ || evt->mono_time > end_mono_time_) {
+      delete evt;
+      continue;
     }
+
+    // Add encodeIdx packet again as a frame packet for the video stream
+    if (evt->which == cereal::Event::ROAD_ENCODE_IDX ||
+        evt->which == cereal::Event::DRIVER_ENCODE_IDX ||
+        evt->which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
+
+#ifdef HAS_MEMORY_RESOURCE
+      Event *frame_evt = new (mbr_) Event(msg, true);
+#else
+      Event *frame_evt = new Event(msg, true);
+#endif
+
+      events.push_back(frame_evt);
+    }
+    events.push_back(evt);
+  }
+  return words;
+}
+
+// adds every message to the index of the decoded cache, whether it's loaded or not
+void LogReader::indexMessage(kj::ArrayPtr<const capnp::word> msg, bool peeked, cereal::Event::Which which, uint64_t mono_time) {
+  if (!peeked) {
+    Event evt(msg);
+    which = evt.which;
+    mono_time = evt.mono_time;
+  }
+  decoded_index_->emplace_back(which, mono_time, msg);
+  if (which == cereal::Event::ROAD_ENCODE_IDX || which == cereal::Event::DRIVER_ENCODE_IDX ||
+      which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
+    decoded_index_->emplace_back(which, Event(msg, true).mono_time, msg, true);
   }
+}
 
+bool LogReader::sortEvents(std::atomic<bool> *abort) {
   if (!events.empty() && !(abort && *abort)) {
     std::sort(events.begin(), events.end(), Event::lessThan());
     return true;
@@ -5,23 +5,29 @@
 #include <memory_resource>
 #endif
 
+#include <functional>
+#include <memory>
 #include <set>
+#include <utility>
+#include <vector>
 
 #include "cereal/gen/cpp/log.capnp.h"
 #include "system/camerad/cameras/camera_common.h"
+#include "system/loggerd/logindex.h"
 #include "tools/replay/filereader.h"
 
 const CameraType ALL_CAMERAS[] = {RoadCam, DriverCam, WideRoadCam};
 const int MAX_CAMERAS = std::size(ALL_CAMERAS);
 const int DEFAULT_EVENT_MEMORY_POOL_BLOCK_SIZE = 65000;
 
+// an Event only holds what's needed to sort and filter the message, it's parsed when it's used:
+//   capnp::FlatArrayMessageReader reader(e->words);
+//   auto event = reader.getRoot<cereal::Event>();
 class Event {
 public:
-  Event(cereal::Event::Which which, uint64_t mono_time) : reader(kj::ArrayPtr<capnp::word>{}) {
-    // construct a dummy Event for binary search, e.g std::upper_bound
-    this->which = which;
-    this->mono_time = mono_time;
-  }
+  // an already indexed message, or a dummy Event for binary search, e.g std::upper_bound
+  Event(cereal::Event::Which which, uint64_t mono_time, const kj::ArrayPtr<const capnp::word> &words = {}, bool frame = false)
+      : mono_time(mono_time), which(which), words(words), frame(frame) {}
   Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame = false);
   inline kj::ArrayPtr<const capnp::byte> bytes() const { return words.asBytes(); }
 
@@ -42,10 +48,8 @@ public:
 
   uint64_t mono_time;
   cereal::Event::Which which;
-  cereal::Event::Reader event;
-  capnp::FlatArrayMessageReader reader;
   kj::ArrayPtr<const capnp::word> words;
-  bool frame;
+  bool frame = false;
 };
 
 class LogReader {
@@ -54,14 +58,54 @@ public:
   ~LogReader();
   bool load(const std::string &url, std::atomic<bool> *abort = nullptr, const std::set<cereal::Event::Which> &allow = {},
             bool local_cache = false, int chunk_size = -1, int retries = 0);
-  bool load(const std::byte *data, size_t size, std::atomic<bool> *abort = nullptr);
+  bool load(const std::byte *data, size_t size, std::atomic<bool> *abort = nullptr,
+            const std::set<cereal::Event::Which> &allow = {});
+  // only load events logged within [begin_mono_time, end_mono_time]
+  inline void setTimeRange(uint64_t begin_mono_time, uint64_t end_mono_time) {
+    begin_mono_time_ = begin_mono_time;
+    end_mono_time_ = end_mono_time;
+  }
+  // keep compressed logs decompressed and indexed in the local cache, so loading them again only maps the cache.
+  // it's built while the log is loaded, and only used when local_cache is set
+  inline void setDecodedCache(bool enable) { decoded_cache_ = enable; }
+  // compressed logs are parsed while they're decompressed. the callback is called from the loading
+  // thread with the index of the first new event every time a chunk was parsed, before events are sorted.
+  using ChunkCallback = std::function<void(const std::vector<Event *> &events, size_t first)>;
+  inline void setChunkCallback(ChunkCallback callback) { chunk_callback_ = callback; }
+  // bytes held by the log and its events, including mapped files
+  size_t memoryUsage() const;
   std::vector<Event*> events;
 
 private:
-  bool parse(const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort);
+  bool loadCompressed(const std::string &url, std::atomic<bool> *abort, const std::set<cereal::Event::Which> &allow,
+                      bool local_cache, int chunk_size, int retries, std::pair<uint64_t, uint64_t> range);
+  bool parse(kj::ArrayPtr<const capnp::word> data, const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort,
+             size_t begin = 0, size_t end = std::string::npos);
+  kj::ArrayPtr<const capnp::word> parseMessages(kj::ArrayPtr<const capnp::word> words, const std::set<cereal::Event::Which> &allow,
+                                                std::atomic<bool> *abort, uint64_t &offset, std::pair<uint64_t, uint64_t> range);
+  bool sortEvents(std::atomic<bool> *abort);
+  bool loadDecodedCache(const std::string &file, const std::set<cereal::Event::Which> &allow, uint64_t source_size, uint64_t source_mtime);
+  bool writeDecodedCache(const std::string &url, const std::vector<Event> &index, uint64_t source_size, uint64_t source_mtime);
+  void indexMessage(kj::ArrayPtr<const capnp::word> msg, bool peeked, cereal::Event::Which which, uint64_t mono_time);
+  bool mapFile(const std::string &file);
   std::string raw_;
+  void *mmap_ = nullptr;
+  size_t mmap_size_ = 0;
+  // the decompressed log, events point into it so blocks never move
+  std::vector<std::unique_ptr<capnp::word[]>> blocks_;
+  size_t blocks_size_ = 0;
+  ChunkCallback chunk_callback_;
+  bool decoded_cache_ = false;
+  // every message of the log while the decoded cache is built, in log order
+  std::vector<Event> *decoded_index_ = nullptr;
+  uint64_t begin_mono_time_ = 0;
+  uint64_t end_mono_time_ = UINT64_MAX;
 #ifdef HAS_MEMORY_RESOURCE
   std::pmr::monotonic_buffer_resource *mbr_ = nullptr;
   void *pool_buffer_ = nullptr;
+  size_t pool_size_ = 0;
 #endif
 };
+
+// the decoded cache file of a compressed log, next to the downloaded files
+std::string decodedCachePath(const std::string &url);
@@ -1,6 +1,8 @@
 #include <QApplication>
 #include <QCommandLineParser>
 
+#include <climits>
+
 #include "common/prefix.h"
 #include "tools/replay/consoleui.h"
 #include "tools/replay/replay.h"
@@ -22,6 +24,7 @@ int main(int argc, char *argv[]) {
       {"qcam", REPLAY_FLAG_QCAMERA, "load qcamera"},
       {"no-hw-decoder", REPLAY_FLAG_NO_HW_DECODER, "disable HW video decoding"},
       {"no-vipc", REPLAY_FLAG_NO_VIPC, "do not output video"},
+      {"decoded-cache", REPLAY_FLAG_DECODED_CACHE, "keep decompressed logs in the local cache for faster reloads"},
       {"all", REPLAY_FLAG_ALL_SERVICES, "do output all messages including " + base_blacklist.join(", ") + 
                                         ". this may causes issues when used along with UI"}
   };
@@ -33,6 +36,8 @@ int main(int argc, char *argv[]) {
   parser.addOption({{"a", "allow"}, "whitelist of services to send", "allow"});
   parser.addOption({{"b", "block"}, "blacklist of services to send", "block"});
   parser.addOption({{"c", "cache"}, "cache <n> segments in memory. default is 5", "n"});
+  parser.addOption({"cache-memory", "limit the segments cached in memory to <mb> MB. without -c the whole route may be cached", "mb"});
+  parser.addOption({"loads", "load <n> segments at a time. default is 2", "n"});
   parser.addOption({{"s", "start"}, "start from <seconds>", "seconds"});
   parser.addOption({"demo", "use a demo route instead of providing your own"});
   parser.addOption({"data_dir", "local directory with routes", "data_dir"});
@@ -68,6 +73,15 @@ int main(int argc, char *argv[]) {
   if (!parser.value("c").isEmpty()) {
     replay->setSegmentCacheLimit(parser.value("c").toInt());
   }
+  if (!parser.value("cache-memory").isEmpty()) {
+    replay->setCacheMemoryLimit(parser.value("cache-memory").toULongLong() * 1024 * 1024);
+    if (parser.value("c").isEmpty()) {
+      replay->setSegmentCacheLimit(INT_MAX);
+    }
+  }
+  if (!parser.value("loads").isEmpty()) {
+    replay->setConcurrentLoads(parser.value("loads").toInt());
+  }
   if (!replay->load()) {
     return 0;
   }
@@ -3,6 +3,11 @@
 #include <QDebug>
 #include <QtConcurrent>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+
 #include <capnp/dynamic.h>
 #include "cereal/services.h"
 #include "common/params.h"
@@ -68,7 +73,8 @@ void Replay::stop() {
     stream_thread_ = nullptr;
   }
   camera_server_.reset(nullptr);
-  timeline_future.waitForFinished();
+  exit_ = true;
+  timeline_loads_.waitForFinished();
   segments_.clear();
   rInfo("shutdown: done");
 }
@@ -92,6 +98,9 @@ bool Replay::load() {
     return false;
   }
   rInfo("load route %s with %zu valid segments", qPrintable(route_->name()), segments_.size());
+  if (!hasFlag(REPLAY_FLAG_NO_FILE_CACHE)) {
+    loadTimelineCache();
+  }
   return true;
 }
 
@@ -135,56 +144,213 @@ void Replay::seekToFlag(FindFlag flag) {
   }
 }
 
-void Replay::buildTimeline() {
-  uint64_t engaged_begin = 0;
-  bool engaged = false;
+void Replay::addTimelineSegment(int n, const std::vector<Event *> &events) {
+  auto &records = timeline_segments_[n];
+  TimelineRecord last;  // the last controlsState, kept to close the intervals at the end of the segment
+  for (const Event *e : events) {
+    if (e->which == cereal::Event::Which::CONTROLS_STATE) {
+      capnp::FlatArrayMessageReader reader(e->words);
+      auto cs = reader.getRoot<cereal::Event>().getControlsState();
+      const bool changed = last.mono_time == 0 || last.enabled != cs.getEnabled() ||
+                           last.alert_type != cs.getAlertType().cStr() || last.alert_status != cs.getAlertStatus();
+      last = {.mono_time = e->mono_time, .enabled = cs.getEnabled(), .alert_status = cs.getAlertStatus(),
+              .alert_size = cs.getAlertSize(), .alert_type = cs.getAlertType().cStr()};
+      if (changed) records.push_back(last);
+    } else if (e->which == cereal::Event::Which::USER_FLAG) {
+      records.push_back({.mono_time = e->mono_time, .user_flag = true});
+    }
+  }
+  auto last_cs = std::find_if(records.rbegin(), records.rend(), [](auto &r) { return !r.user_flag; });
+  if (last.mono_time != 0 && last_cs != records.rend() && last_cs->mono_time != last.mono_time) {
+    records.push_back(last);
+  }
+  std::stable_sort(records.begin(), records.end(), [](auto &l, auto &r) { return l.mono_time < r.mono_time; });
+}
 
-  auto alert_status = cereal::ControlsState::AlertStatus::NORMAL;
-  auto alert_size = cereal::ControlsState::AlertSize::NONE;
-  uint64_t alert_begin = 0;
-  std::string alert_type;
+// the log of the segment doesn't have the services of the timeline, they're read from its qlog
+void Replay::loadTimelineSegment(int n) {
+  const std::string qlog = route_->at(n).qlog.toStdString();
+  if (qlog.empty() || !timeline_loading_.insert(n).second) return;
+
+  timeline_loads_.addFuture(QtConcurrent::run([this, n, qlog]() {
+    auto log = std::make_shared<LogReader>();
+    log->setDecodedCache(hasFlag(REPLAY_FLAG_DECODED_CACHE));
+    if (!log->load(qlog, &exit_, {cereal::Event::Which::CONTROLS_STATE, cereal::Event::Which::USER_FLAG},
+                   !hasFlag(REPLAY_FLAG_NO_FILE_CACHE), 0, 3)) {
+      return;
+    }
+    QMetaObject::invokeMethod(this, [this, n, log]() {
+      if (timeline_segments_.count(n) == 0) {
+        addTimelineSegment(n, log->events);
+        timelineSegmentAdded();
+      }
+    }, Qt::QueuedConnection);
+  }));
+}
 
+void Replay::timelineSegmentAdded() {
+  if (!hasFlag(REPLAY_FLAG_NO_FILE_CACHE)) {
+    saveTimelineCache();
+  }
+  // the timeline is relative to the route start, it's built once the stream started
+  if (stream_thread_) {
+    updateTimeline();
+  }
+}
+
+void Replay::updateTimeline() {
   const TimelineType timeline_types[] = {
     [(int)cereal::ControlsState::AlertStatus::NORMAL] = TimelineType::AlertInfo,
     [(int)cereal::ControlsState::AlertStatus::USER_PROMPT] = TimelineType::AlertWarning,
     [(int)cereal::ControlsState::AlertStatus::CRITICAL] = TimelineType::AlertCritical,
   };
 
-  for (auto it = segments_.cbegin(); it != segments_.cend() && !exit_; ++it) {
-    LogReader log;
-    if (!log.load(route_->at(it->first).qlog.toStdString(), &exit_,
-                  {cereal::Event::Which::CONTROLS_STATE, cereal::Event::Which::USER_FLAG},
-                  !hasFlag(REPLAY_FLAG_NO_FILE_CACHE), 0, 3)) continue;
+  std::vector<std::tuple<double, double, TimelineType>> new_timeline;
+  bool engaged = false;
+  uint64_t engaged_begin = 0;
+  TimelineRecord alert;
+  uint64_t last_mono_time = 0;
+  // ends the engagement and the alert at mono_time
+  auto close = [&](uint64_t mono_time) {
+    if (engaged) {
+      new_timeline.push_back({toSeconds(engaged_begin), toSeconds(mono_time), TimelineType::Engaged});
+    }
+    if (!alert.alert_type.empty() && alert.alert_size != cereal::ControlsState::AlertSize::NONE) {
+      new_timeline.push_back({toSeconds(alert.mono_time), toSeconds(mono_time), timeline_types[(int)alert.alert_status]});
+    }
+  };
 
-    for (const Event *e : log.events) {
-      if (e->which == cereal::Event::Which::CONTROLS_STATE) {
-        auto cs = e->event.getControlsState();
+  int prev_n = -1;
+  for (const auto &[n, records] : timeline_segments_) {
+    if (prev_n != -1 && n != prev_n + 1) {
+      // the segments in between aren't known yet
+      close(last_mono_time);
+      engaged = false;
+      alert = {};
+    }
+    prev_n = n;
 
-        if (engaged != cs.getEnabled()) {
-          if (engaged) {
-            std::lock_guard lk(timeline_lock);
-            timeline.push_back({toSeconds(engaged_begin), toSeconds(e->mono_time), TimelineType::Engaged});
-          }
-          engaged_begin = e->mono_time;
-          engaged = cs.getEnabled();
+    for (const auto &r : records) {
+      if (r.user_flag) {
+        new_timeline.push_back({toSeconds(r.mono_time), toSeconds(r.mono_time), TimelineType::UserFlag});
+        continue;
+      }
+      if (engaged != r.enabled) {
+        if (engaged) {
+          new_timeline.push_back({toSeconds(engaged_begin), toSeconds(r.mono_time), TimelineType::Engaged});
         }
-
-        if (alert_type != cs.getAlertType().cStr() || alert_status != cs.getAlertStatus()) {
-          if (!alert_type.empty() && alert_size != cereal::ControlsState::AlertSize::NONE) {
-            std::lock_guard lk(timeline_lock);
-            timeline.push_back({toSeconds(alert_begin), toSeconds(e->mono_time), timeline_types[(int)alert_status]});
-          }
-          alert_begin = e->mono_time;
-          alert_type = cs.getAlertType().cStr();
-          alert_size = cs.getAlertSize();
-          alert_status = cs.getAlertStatus();
+        engaged_begin = r.mono_time;
+        engaged = r.enabled;
+      }
+      if (alert.alert_type != r.alert_type || alert.alert_status != r.alert_status) {
+        if (!alert.alert_type.empty() && alert.alert_size != cereal::ControlsState::AlertSize::NONE) {
+          new_timeline.push_back({toSeconds(alert.mono_time), toSeconds(r.mono_time), timeline_types[(int)alert.alert_status]});
         }
-      } else if (e->which == cereal::Event::Which::USER_FLAG) {
-        std::lock_guard lk(timeline_lock);
-        timeline.push_back({toSeconds(e->mono_time), toSeconds(e->mono_time), TimelineType::UserFlag});
+        alert = r;
       }
+      last_mono_time = r.mono_time;
     }
   }
+  close(last_mono_time);
+  std::sort(new_timeline.begin(), new_timeline.end());
+
+  std::lock_guard lk(timeline_lock);
+  timeline.swap(new_timeline);
+}
+
+namespace {
+
+// the timeline cache of a route: for every segment that was loaded, its TimelineRecords
+const char TIMELINE_CACHE_MAGIC[4] = {'R', 'L', 'T', 'L'};
+const uint16_t TIMELINE_CACHE_VERSION = 1;
+
+template <class T>
+void append_value(std::string &out, T v) { out.append((const char *)&v, sizeof(v)); }
+
+template <class T>
+bool read_value(const std::string &data, size_t &pos, T &v) {
+  if (data.size() - pos < sizeof(v)) return false;
+  memcpy(&v, &data[pos], sizeof(v));
+  pos += sizeof(v);
+  return true;
+}
+
+}  // namespace
+
+std::string Replay::timelineCachePath() const {
+  return cacheFilePath((route_->dir() + "/" + route_->name()).toStdString()) + ".timeline";
+}
+
+bool Replay::loadTimelineCache() {
+  const std::string data = util::read_file(timelineCachePath());
+  if (data.empty()) return false;
+
+  size_t pos = sizeof(TIMELINE_CACHE_MAGIC);
+  uint16_t version = 0, reserved = 0;
+  uint32_t segment_cnt = 0;
+  bool valid = data.size() >= pos && memcmp(data.data(), TIMELINE_CACHE_MAGIC, pos) == 0 &&
+               read_value(data, pos, version) && version == TIMELINE_CACHE_VERSION && read_value(data, pos, reserved) &&
+               read_value(data, pos, segment_cnt);
+  std::map<int, std::vector<TimelineRecord>> segments;
+  for (uint32_t i = 0; valid && i < segment_cnt; ++i) {
+    int32_t n = 0;
+    uint32_t record_cnt = 0;
+    valid = read_value(data, pos, n) && read_value(data, pos, record_cnt);
+    auto &records = segments[n];
+    for (uint32_t j = 0; valid && j < record_cnt; ++j) {
+      TimelineRecord r;
+      uint8_t user_flag = 0, enabled = 0, alert_status = 0, alert_size = 0;
+      uint16_t alert_type_len = 0;
+      valid = read_value(data, pos, r.mono_time) && read_value(data, pos, user_flag) && read_value(data, pos, enabled) &&
+              read_value(data, pos, alert_status) && read_value(data, pos, alert_size) && read_value(data, pos, alert_type_len) &&
+              alert_status <= (uint8_t)cereal::ControlsState::AlertStatus::CRITICAL && data.size() - pos >= alert_type_len;
+      if (valid) {
+        r.user_flag = user_flag;
+        r.enabled = enabled;
+        r.alert_status = (cereal::ControlsState::AlertStatus)alert_status;
+        r.alert_size = (cereal::ControlsState::AlertSize)alert_size;
+        r.alert_type.assign(&data[pos], alert_type_len);
+        pos += alert_type_len;
+        records.push_back(std::move(r));
+      }
+    }
+  }
+  if (!valid || pos != data.size()) {
+    rWarning("timeline cache %s is corrupt", timelineCachePath().c_str());
+    return false;
+  }
+  timeline_segments_.merge(segments);
+  return true;
+}
+
+void Replay::saveTimelineCache() const {
+  std::string out(TIMELINE_CACHE_MAGIC, sizeof(TIMELINE_CACHE_MAGIC));
+  append_value(out, TIMELINE_CACHE_VERSION);
+  append_value(out, (uint16_t)0);
+  append_value(out, (uint32_t)timeline_segments_.size());
+  for (const auto &[n, records] : timeline_segments_) {
+    append_value(out, (int32_t)n);
+    append_value(out, (uint32_t)records.size());
+    for (const auto &r : records) {
+      append_value(out, r.mono_time);
+      append_value(out, (uint8_t)r.user_flag);
+      append_value(out, (uint8_t)r.enabled);
+      append_value(out, (uint8_t)r.alert_status);
+      append_value(out, (uint8_t)r.alert_size);
+      const size_t alert_type_len = std::min<size_t>(r.alert_type.size(), UINT16_MAX);
+      append_value(out, (uint16_t)alert_type_len);
+      out.append(r.alert_type, 0, alert_type_len);
+    }
+  }
+
+  // written next to the cache and renamed, a reader never sees a partial file
+  const std::string file = timelineCachePath();
+  const std::string tmp = file + ".tmp" + std::to_string(getpid());
+  if (util::write_file(tmp.c_str(), out.data(), out.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0 ||
+      rename(tmp.c_str(), file.c_str()) != 0) {
+    rWarning("failed to write timeline cache %s", file.c_str());
+    unlink(tmp.c_str());
+  }
 }
 
 std::optional<uint64_t> Replay::find(FindFlag flag) {
@@ -222,11 +388,23 @@ void Replay::setCurrentSegment(int n) {
   }
 }
 
-void Replay::segmentLoadFinished(bool success) {
-  if (!success) {
-    Segment *seg = qobject_cast<Segment *>(sender());
-    rWarning("failed to load segment %d, removing it from current replay list", seg->seg_num);
-    segments_.erase(seg->seg_num);
+void Replay::segmentLoadFinished(int n, const QPointer<Segment> &seg, bool success) {
+  // the segment may have been cancelled or replaced by a new load after it finished.
+  // seg is null once the segment is deleted, so a new segment at the same address can't match.
+  auto it = segments_.find(n);
+  if (seg && it != segments_.end() && it->second.get() == seg) {
+    if (!success) {
+      rWarning("failed to load segment %d, removing it from current replay list", it->first);
+      segments_.erase(it);
+    } else if (it->second->isLoaded() && timeline_segments_.count(it->first) == 0) {
+      if (allow_list.empty() || (allow_list.count(cereal::Event::Which::CONTROLS_STATE) &&
+                                 allow_list.count(cereal::Event::Which::USER_FLAG))) {
+        addTimelineSegment(it->first, it->second->log->events);
+        timelineSegmentAdded();
+      } else {
+        loadTimelineSegment(it->first);
+      }
+    }
   }
   queueSegment();
 }
@@ -245,16 +423,64 @@ void Replay::queueSegment() {
     ++end;
   }
 
-  // load one segment at a time
+  // load order: the current segment, the ones after it, then the ones before it
+  std::vector<SegmentMap::iterator> load_order;
   for (auto it = cur; it != end; ++it) {
+    load_order.push_back(it);
+  }
+  for (auto it = cur; it != begin;) {
+    load_order.push_back(--it);
+  }
+
+  // the segments that aren't loaded are assumed to use as much memory as the last time they were loaded,
+  // or as the largest segment if they never were. an evicted segment then doesn't fit until the limit changes
+  size_t largest_memory = 0;
+  for (auto &[n, seg] : segments_) {
+    if (seg && seg->isLoaded()) {
+      segment_memory_[n] = seg->memoryUsage();
+    }
+  }
+  for (auto &[n, bytes] : segment_memory_) {
+    largest_memory = std::max(largest_memory, bytes);
+  }
+
+  // load up to concurrent_loads segments at a time. a seek can leave loads of
+  // lower priority segments running, they are cancelled and restarted later.
+  int loading = 0;
+  size_t memory = 0;
+  // evicted segments are freed once their events are no longer merged
+  std::vector<std::unique_ptr<Segment>> evicted;
+  for (auto it : load_order) {
     auto &[n, seg] = *it;
-    if ((seg && !seg->isLoaded()) || !seg) {
+    const bool loaded = seg && seg->isLoaded();
+    // keep the segments that fit in the memory limit in load order, the current one always
+    if (loaded) {
+      memory += seg->memoryUsage();
+    } else {
+      auto measured = segment_memory_.find(n);
+      memory += measured != segment_memory_.end() ? measured->second : largest_memory;
+    }
+    if (cache_memory_limit > 0 && memory > cache_memory_limit && it != cur) {
+      if (seg) {
+        rDebug("evict segment %d, the cache uses more than %s", n, formattedDataSize(cache_memory_limit).c_str());
+        evicted.push_back(std::move(seg));
+      }
+      continue;
+    }
+    if (loaded) continue;
+
+    if (loading < concurrent_loads) {
       if (!seg) {
         rDebug("loading segment %d...", n);
         seg = std::make_unique<Segment>(n, route_->at(n), flags_, allow_list);
-        QObject::connect(seg.get(), &Segment::loadFinished, this, &Replay::segmentLoadFinished);
+        QObject::connect(seg.get(), &Segment::loadFinished, this, [this, n = n, s = QPointer<Segment>(seg.get())](bool success) {
+          segmentLoadFinished(n, s, success);
+        });
       }
-      break;
+      ++loading;
+    } else if (seg) {
+      rDebug("cancel loading segment %d", n);
+      seg.reset(nullptr);
     }
   }
 
@@ -263,6 +489,7 @@ void Replay::queueSegment() {
   // free segments out of current semgnt window.
   std::for_each(segments_.begin(), begin, [](auto &e) { e.second.reset(nullptr); });
   std::for_each(end, segments_.end(), [](auto &e) { e.second.reset(nullptr); });
+  evicted.clear();
 
   // start stream thread
   const auto &cur_segment = cur->second;
@@ -272,6 +499,20 @@ void Replay::queueSegment() {
   }
 }
 
+Replay::CacheStats Replay::cacheStats() const {
+  CacheStats stats;
+  for (auto &[n, seg] : segments_) {
+    if (!seg) continue;
+    if (seg->isLoaded()) {
+      ++stats.loaded;
+      stats.memory += seg->memoryUsage();
+    } else {
+      ++stats.loading;
+    }
+  }
+  return stats;
+}
+
 void Replay::mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end) {
   std::vector<int> segments_need_merge;
   size_t new_events_size = 0;
@@ -324,13 +565,18 @@ void Replay::startStream(const Segment *cur_segment) {
   // write CarParams
   it = std::find_if(events.begin(), events.end(), [](auto e) { return e->which == cereal::Event::Which::CAR_PARAMS; });
   if (it != events.end()) {
-    car_fingerprint_ = (*it)->event.getCarParams().getCarFingerprint();
+    capnp::FlatArrayMessageReader reader((*it)->words);
+    auto car_params = reader.getRoot<cereal::Event>().getCarParams();
+    car_fingerprint_ = car_params.getCarFingerprint();
     capnp::MallocMessageBuilder builder;
-    builder.setRoot((*it)->event.getCarParams());
+    builder.setRoot(car_params);
     auto words = capnp::messageToFlatArray(builder);
     auto bytes = words.asBytes();
-    Params().put("CarParams", (const char *)bytes.begin(), bytes.size());
-    Params().put("CarParamsPersistent", (const char *)bytes.begin(), bytes.size());
+    Params params;
+    Params::Transaction tx(params);
+    tx.put("CarParams", std::string((const char *)bytes.begin(), bytes.size()));
+    tx.put("CarParamsPersistent", std::string((const char *)bytes.begin(), bytes.size()));
+    tx.commit();
   } else {
     rWarning("failed to read CarParams from current segment");
   }
@@ -353,7 +599,7 @@ void Replay::startStream(const Segment *cur_segment) {
   QObject::connect(stream_thread_, &QThread::finished, stream_thread_, &QThread::deleteLater);
   stream_thread_->start();
 
-  timeline_future = QtConcurrent::run(this, &Replay::buildTimeline);
+  updateTimeline();
 }
 
 void Replay::publishMessage(const Event *e) {
@@ -367,7 +613,8 @@ void Replay::publishMessage(const Event *e) {
       sockets_[e->which] = nullptr;
     }
   } else {
-    sm->update_msgs(nanos_since_boot(), {{sockets_[e->which], e->event}});
+    capnp::FlatArrayMessageReader reader(e->words);
+    sm->update_msgs(nanos_since_boot(), {{sockets_[e->which], reader.getRoot<cereal::Event>()}});
   }
 }
 
@@ -381,7 +628,8 @@ void Replay::publishFrame(const Event *e) {
       (e->which == cereal::Event::WIDE_ROAD_ENCODE_IDX && !hasFlag(REPLAY_FLAG_ECAM))) {
     return;
   }
-  auto eidx = capnp::AnyStruct::Reader(e->event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+  capnp::FlatArrayMessageReader reader(e->words);
+  auto eidx = capnp::AnyStruct::Reader(reader.getRoot<cereal::Event>()).getPointerSection()[0].getAs<cereal::EncodeIndex>();
   if (eidx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C && isSegmentMerged(eidx.getSegmentNum())) {
     CameraType cam = cam_types.at(e->which);
     camera_server_->pushFrame(cam, segments_[eidx.getSegmentNum()]->frames[cam].get(), eidx);
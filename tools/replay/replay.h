@@ -2,6 +2,7 @@
 
 #include <optional>
 
+#include <QPointer>
 #include <QThread>
 
 #include "tools/replay/camera.h"
@@ -9,8 +10,11 @@
 
 const QString DEMO_ROUTE = "a2a0ccea32023010|2023-07-27--13-01-19";
 
-// one segment uses about 100M of memory
+// the cache window in segments. how much memory a segment uses depends on the cameras and services
+// loaded, setCacheMemoryLimit() limits the cache by the memory the segments really use.
 constexpr int MIN_SEGMENTS_CACHE = 5;
+// segments of the cache window loaded at the same time
+constexpr int DEFAULT_CONCURRENT_LOADS = 2;
 
 enum REPLAY_FLAGS {
   REPLAY_FLAG_NONE = 0x0000,
@@ -23,6 +27,7 @@ enum REPLAY_FLAGS {
   REPLAY_FLAG_FULL_SPEED = 0x0200,
   REPLAY_FLAG_NO_VIPC = 0x0400,
   REPLAY_FLAG_ALL_SERVICES = 0x0800,
+  REPLAY_FLAG_DECODED_CACHE = 0x1000,
 };
 
 enum class FindFlag {
@@ -60,6 +65,18 @@ public:
   }
   inline int segmentCacheLimit() const { return segment_cache_limit; }
   inline void setSegmentCacheLimit(int n) { segment_cache_limit = std::max(MIN_SEGMENTS_CACHE, n); }
+  // 0 for no limit. segments of the window that don't fit are evicted in reverse load order
+  inline size_t cacheMemoryLimit() const { return cache_memory_limit; }
+  inline void setCacheMemoryLimit(size_t bytes) { cache_memory_limit = bytes; }
+  struct CacheStats {
+    int loaded = 0;
+    int loading = 0;
+    size_t memory = 0;  // bytes held by the loaded segments
+  };
+  // call it from the thread Replay lives in
+  CacheStats cacheStats() const;
+  inline int concurrentLoads() const { return concurrent_loads; }
+  inline void setConcurrentLoads(int n) { concurrent_loads = std::max(1, n); }
   inline bool hasFlag(REPLAY_FLAGS flag) const { return flags_ & flag; }
   inline void addFlag(REPLAY_FLAGS flag) { flags_ |= flag; }
   inline void removeFlag(REPLAY_FLAGS flag) { flags_ &= ~flag; }
@@ -84,10 +101,8 @@ signals:
   void segmentsMerged();
   void seekedTo(double sec);
 
-protected slots:
-  void segmentLoadFinished(bool success);
-
 protected:
+  void segmentLoadFinished(int n, const QPointer<Segment> &seg, bool success);
   typedef std::map<int, std::unique_ptr<Segment>> SegmentMap;
   std::optional<uint64_t> find(FindFlag flag);
   void startStream(const Segment *cur_segment);
@@ -98,7 +113,23 @@ protected:
   void updateEvents(const std::function<bool()>& lambda);
   void publishMessage(const Event *e);
   void publishFrame(const Event *e);
-  void buildTimeline();
+
+  // the controlsState changes and user flags of a segment, the timeline is built from them
+  struct TimelineRecord {
+    uint64_t mono_time = 0;
+    bool user_flag = false;
+    bool enabled = false;
+    cereal::ControlsState::AlertStatus alert_status = cereal::ControlsState::AlertStatus::NORMAL;
+    cereal::ControlsState::AlertSize alert_size = cereal::ControlsState::AlertSize::NONE;
+    std::string alert_type;
+  };
+  void addTimelineSegment(int n, const std::vector<Event *> &events);
+  void loadTimelineSegment(int n);
+  void timelineSegmentAdded();
+  void updateTimeline();
+  std::string timelineCachePath() const;
+  bool loadTimelineCache();
+  void saveTimelineCache() const;
   inline bool isSegmentMerged(int n) {
     return std::find(segments_merged_.begin(), segments_merged_.end(), n) != segments_merged_.end();
   }
@@ -130,12 +161,20 @@ protected:
   std::atomic<uint32_t> flags_ = REPLAY_FLAG_NONE;
 
   std::mutex timeline_lock;
-  QFuture<void> timeline_future;
   std::vector<std::tuple<double, double, TimelineType>> timeline;
+  // segments the timeline was extracted from, only used in the thread Replay lives in
+  std::map<int, std::vector<TimelineRecord>> timeline_segments_;
+  // segments whose qlog is read for the timeline, they're loaded with an allow list without its services
+  std::set<int> timeline_loading_;
+  QFutureSynchronizer<void> timeline_loads_;
   std::set<cereal::Event::Which> allow_list;
   std::string car_fingerprint_;
   float speed_ = 1.0;
   replayEventFilter event_filter = nullptr;
   void *filter_opaque = nullptr;
   int segment_cache_limit = MIN_SEGMENTS_CACHE;
+  int concurrent_loads = DEFAULT_CONCURRENT_LOADS;
+  size_t cache_memory_limit = 0;
+  // the memory usage of the segments measured when they were loaded, only used in the thread Replay lives in
+  std::map<int, size_t> segment_memory_;
 };
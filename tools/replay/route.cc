@@ -83,9 +83,9 @@ void Route::addFileToSegment(int n, const QString &file) {
   const int pos = name.lastIndexOf("--");
   name = pos != -1 ? name.mid(pos + 2) : name;
 
-  if (name == "rlog.bz2" || name == "rlog") {
+  if (name == "rlog.bz2" || name == "rlog.zst" || name == "rlog") {
     segments_[n].rlog = file;
-  } else if (name == "qlog.bz2" || name == "qlog") {
+  } else if (name == "qlog.bz2" || name == "qlog.zst" || name == "qlog") {
     segments_[n].qlog = file;
   } else if (name == "fcamera.hevc") {
     segments_[n].road_cam = file;
@@ -131,9 +131,12 @@ void Segment::loadFile(int id, const std::string file) {
   if (id < MAX_CAMERAS) {
     frames[id] = std::make_unique<FrameReader>();
     success = frames[id]->load(file, flags & REPLAY_FLAG_NO_HW_DECODER, &abort_, local_cache, 20 * 1024 * 1024, 3);
+    memory_usage_ += frames[id]->memoryUsage();
   } else {
     log = std::make_unique<LogReader>();
+    log->setDecodedCache(flags & REPLAY_FLAG_DECODED_CACHE);
     success = log->load(file, &abort_, allow, local_cache, 0, 3);
+    memory_usage_ += log->memoryUsage();
   }
 
   if (!success) {
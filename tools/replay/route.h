@@ -53,6 +53,8 @@ public:
   Segment(int n, const SegmentFile &files, uint32_t flags, const std::set<cereal::Event::Which> &allow = {});
   ~Segment();
   inline bool isLoaded() const { return !loading_ && !abort_; }
+  // bytes held by the loaded log and frame readers
+  inline size_t memoryUsage() const { return memory_usage_; }
 
   const int seg_num = 0;
   std::unique_ptr<LogReader> log;
@@ -66,6 +68,7 @@ protected:
 
   std::atomic<bool> abort_ = false;
   std::atomic<int> loading_ = 0;
+  std::atomic<size_t> memory_usage_ = 0;
   QFutureSynchronizer<void> synchronizer_;
   uint32_t flags;
   std::set<cereal::Event::Which> allow;
@@ -1,10 +1,25 @@
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <set>
 #include <thread>
 
 #include <QDebug>
 #include <QEventLoop>
 
 #include "catch2/catch.hpp"
+#include "common/timing.h"
 #include "common/util.h"
 #include "tools/replay/replay.h"
 #include "tools/replay/util.h"
@@ -58,6 +73,44 @@ TEST_CASE("FileReader") {
   }
 }
 
+std::string decompress_bz2(const std::string &in, int threads) {
+  std::string out;
+  bool ret = decompressBZ2Parallel((const std::byte *)in.data(), in.size(), [&](const char *data, size_t size) {
+    out.append(data, size);
+    return true;
+  }, nullptr, threads);
+  return ret ? out : "";
+}
+
+TEST_CASE("decompressBZ2Parallel") {
+  std::string content = FileReader(true).read(TEST_RLOG_URL);
+  SECTION("blocks decoded in parallel") {
+    const std::string expected = decompress_bz2(content, 1);
+    REQUIRE(expected.size() > 0);
+    REQUIRE(decompress_bz2(content, 4) == expected);
+    // concatenated streams
+    REQUIRE(decompress_bz2(content + content, 4) == expected + expected);
+  }
+  SECTION("truncated content") {
+    content.resize(content.size() / 2);
+    const std::string expected = decompress_bz2(content, 1);
+    REQUIRE(expected.size() > 0);
+    REQUIRE(decompress_bz2(content, 4) == expected);
+  }
+}
+
+TEST_CASE("decompressBZ2Parallel benchmark", "[.][benchmark]") {
+  const std::string content = FileReader(true).read(TEST_RLOG_URL);
+  const int threads = std::thread::hardware_concurrency();
+  printf("%s, %zu bytes\n", TEST_RLOG_URL.c_str(), content.size());
+  for (int n : {1, 2, threads}) {
+    double start_ms = millis_since_boot();
+    const size_t size = decompress_bz2(content, n).size();
+    const double elapsed_ms = millis_since_boot() - start_ms;
+    printf("  %d thread(s): %.0f ms, %.1f MB/s\n", n, elapsed_ms, size / 1e3 / elapsed_ms);
+  }
+}
+
 TEST_CASE("LogReader") {
   SECTION("corrupt log") {
     FileReader reader(true);
@@ -68,6 +121,247 @@ TEST_CASE("LogReader") {
     REQUIRE(log.load((std::byte *)corrupt_content.data(), corrupt_content.size()));
     REQUIRE(log.events.size() > 0);
   }
+  SECTION("streamed decompression") {
+    FileReader reader(true);
+    std::string content = decompressBZ2(reader.read(TEST_RLOG_URL));
+    LogReader whole;
+    REQUIRE(whole.load((std::byte *)content.data(), content.size()));
+
+    // parsed from the cached file while it's decompressed
+    LogReader streamed;
+    size_t chunks = 0, parsed = 0;
+    streamed.setChunkCallback([&](const std::vector<Event *> &events, size_t first) {
+      REQUIRE(first == parsed);
+      parsed = events.size();
+      ++chunks;
+    });
+    REQUIRE(streamed.load(TEST_RLOG_URL, nullptr, {}, true));
+    REQUIRE(chunks > 1);
+    REQUIRE(parsed == streamed.events.size());
+    REQUIRE(streamed.events.size() == whole.events.size());
+    for (size_t i = 0; i < whole.events.size(); ++i) {
+      REQUIRE(streamed.events[i]->bytes() == whole.events[i]->bytes());
+    }
+
+    // both hold the whole decompressed log
+    const size_t events_size = whole.events.size() * (sizeof(Event) + sizeof(Event *));
+    REQUIRE(whole.memoryUsage() >= content.size() + events_size);
+    REQUIRE(streamed.memoryUsage() >= content.size() + events_size);
+  }
+  SECTION("allow list") {
+    std::string content = decompressBZ2(FileReader(true).read(TEST_RLOG_URL));
+    LogReader all;
+    REQUIRE(all.load((std::byte *)content.data(), content.size()));
+
+    const std::set<cereal::Event::Which> allow = {cereal::Event::CAR_STATE, cereal::Event::ROAD_ENCODE_IDX, cereal::Event::INIT_DATA};
+    std::vector<Event *> expected;
+    std::copy_if(all.events.begin(), all.events.end(), std::back_inserter(expected), [&](Event *e) { return allow.count(e->which); });
+    REQUIRE(expected.size() > 0);
+
+    LogReader filtered;
+    REQUIRE(filtered.load((std::byte *)content.data(), content.size(), nullptr, allow));
+    REQUIRE(filtered.events.size() == expected.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+      REQUIRE(filtered.events[i]->which == expected[i]->which);
+      REQUIRE(filtered.events[i]->mono_time == expected[i]->mono_time);
+      REQUIRE(filtered.events[i]->bytes() == expected[i]->bytes());
+    }
+  }
+  SECTION("mapped log") {
+    std::string content = decompressBZ2(FileReader(true).read(TEST_RLOG_URL));
+    const std::string file = "/tmp/test_replay_mapped_rlog";
+    util::write_file(file.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT | O_TRUNC);
+    LogReader copied, mapped;
+    REQUIRE(copied.load((std::byte *)content.data(), content.size()));
+    REQUIRE(mapped.load(file));
+    REQUIRE(mapped.events.size() == copied.events.size());
+    for (size_t i = 0; i < copied.events.size(); ++i) {
+      REQUIRE(mapped.events[i]->which == copied.events[i]->which);
+      REQUIRE(mapped.events[i]->mono_time == copied.events[i]->mono_time);
+      REQUIRE(mapped.events[i]->bytes() == copied.events[i]->bytes());
+    }
+  }
+  SECTION("truncated compressed log") {
+    FileReader reader(true);
+    std::string content = reader.read(TEST_RLOG_URL);
+    const std::string truncated_file = "/tmp/test_replay_truncated_rlog.bz2";
+    util::write_file(truncated_file.c_str(), content.data(), content.size() / 2, O_WRONLY | O_CREAT | O_TRUNC);
+    LogReader log;
+    REQUIRE(log.load(truncated_file));
+    REQUIRE(log.events.size() > 0);
+  }
+}
+
+TEST_CASE("LogReader allow list benchmark", "[.][benchmark]") {
+  std::string content = decompressBZ2(FileReader(true).read(TEST_RLOG_URL));
+  LogReader all;
+  REQUIRE(all.load((std::byte *)content.data(), content.size()));
+
+  // services from the rarest to the most frequent one
+  std::map<cereal::Event::Which, size_t> counts;
+  for (const Event *e : all.events) {
+    if (!e->frame) ++counts[e->which];
+  }
+  std::vector<std::pair<size_t, cereal::Event::Which>> services;
+  for (auto &[which, cnt] : counts) services.push_back({cnt, which});
+  std::sort(services.begin(), services.end());
+
+  printf("%s, %zu events of %zu services\n", TEST_RLOG_URL.c_str(), all.events.size(), services.size());
+  std::set<cereal::Event::Which> allow;
+  for (size_t n : {(size_t)1, (size_t)4, (size_t)16, services.size() / 2, services.size()}) {
+    while (allow.size() < std::min(n, services.size())) allow.insert(services[allow.size()].second);
+    const int runs = 5;
+    size_t event_cnt = 0;
+    double start_ms = millis_since_boot();
+    for (int i = 0; i < runs; ++i) {
+      LogReader log;
+      log.load((std::byte *)content.data(), content.size(), nullptr, allow);
+      event_cnt = log.events.size();
+    }
+    printf("  %3zu services: %.1f ms, %zu events\n", allow.size(), (millis_since_boot() - start_ms) / runs, event_cnt);
+  }
+}
+
+void require_same_events(const std::vector<Event *> &events, const std::vector<Event *> &expected) {
+  REQUIRE(events.size() == expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    REQUIRE(events[i]->which == expected[i]->which);
+    REQUIRE(events[i]->mono_time == expected[i]->mono_time);
+    REQUIRE(events[i]->frame == expected[i]->frame);
+    REQUIRE(events[i]->bytes() == expected[i]->bytes());
+  }
+}
+
+// it changes when the file is replaced
+ino_t inode(const std::string &file) {
+  struct stat st = {};
+  return stat(file.c_str(), &st) == 0 ? st.st_ino : 0;
+}
+
+TEST_CASE("LogReader decoded cache") {
+  const std::string content = FileReader(true).read(TEST_RLOG_URL);
+  const std::string log_file = "/tmp/test_replay_decoded_cache/rlog.bz2";
+  util::create_directories(util::dir_name(log_file), 0755);
+  util::write_file(log_file.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT | O_TRUNC);
+  const std::string cache_file = decodedCachePath(log_file);
+  unlink(cache_file.c_str());
+
+  LogReader expected;
+  REQUIRE(expected.load(log_file));
+  auto load_cached = [&](const std::set<cereal::Event::Which> &allow = {}) {
+    LogReader log;
+    log.setDecodedCache(true);
+    REQUIRE(log.load(log_file, nullptr, allow, true));
+    std::vector<Event *> expected_events;
+    std::copy_if(expected.events.begin(), expected.events.end(), std::back_inserter(expected_events),
+                 [&](Event *e) { return allow.empty() || allow.count(e->which); });
+    require_same_events(log.events, expected_events);
+  };
+
+  // the first load writes the cache
+  load_cached();
+  const ino_t cache_inode = inode(cache_file);
+  REQUIRE(cache_inode != 0);
+
+  SECTION("reloaded from the cache") {
+    load_cached();
+    load_cached({cereal::Event::CAN, cereal::Event::ROAD_ENCODE_IDX});
+    REQUIRE(inode(cache_file) == cache_inode);
+  }
+  SECTION("written by a filtered load") {
+    unlink(cache_file.c_str());
+    load_cached({cereal::Event::CAN});
+    REQUIRE(inode(cache_file) != 0);
+    load_cached();
+  }
+  SECTION("file cache disabled") {
+    unlink(cache_file.c_str());
+    LogReader log;
+    log.setDecodedCache(true);
+    REQUIRE(log.load(log_file, nullptr, {}, false));
+    require_same_events(log.events, expected.events);
+    REQUIRE(inode(cache_file) == 0);
+  }
+  SECTION("log changed") {
+    struct timeval times[2] = {{.tv_sec = time(nullptr) + 10}, {.tv_sec = time(nullptr) + 10}};
+    REQUIRE(utimes(log_file.c_str(), times) == 0);
+    load_cached();
+    REQUIRE(inode(cache_file) != cache_inode);
+  }
+  SECTION("corrupt cache") {
+    // offsets of the header and index fields
+    const size_t event_cnt_pos = 24, first_entry_pos = 40, entry_size = 24;
+    std::string cache = util::read_file(cache_file);
+    uint64_t event_cnt = 0, offset = 0;
+    memcpy(&event_cnt, &cache[event_cnt_pos], sizeof(event_cnt));
+    memcpy(&offset, &cache[first_entry_pos + 8], sizeof(offset));
+    SECTION("bad magic") {
+      cache[0] = 'X';
+    }
+    SECTION("truncated") {
+      cache.resize(cache.size() / 2);
+    }
+    SECTION("index out of range") {
+      memset(&cache[first_entry_pos + 8], 0xff, sizeof(offset));
+    }
+    SECTION("bad message") {
+      // segment count of the first message
+      memset(&cache[first_entry_pos + event_cnt * entry_size + offset * sizeof(capnp::word)], 0xff, 4);
+    }
+    util::write_file(cache_file.c_str(), cache.data(), cache.size(), O_WRONLY | O_CREAT | O_TRUNC);
+    load_cached();
+    REQUIRE(inode(cache_file) != cache_inode);
+  }
+}
+
+// runs load in a child process, so every run starts with a clean peak RSS
+void bench_load(const char *name, std::function<bool(std::function<void()> on_events)> load) {
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+  pid_t pid = fork();
+  if (pid == 0) {
+    double result[3] = {};
+    double start_ms = millis_since_boot();
+    bool ret = load([&]() {
+      if (result[0] == 0) result[0] = millis_since_boot() - start_ms;
+    });
+    result[1] = millis_since_boot() - start_ms;
+    struct rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    result[2] = ret ? usage.ru_maxrss / 1024. : -1;
+    write(fds[1], result, sizeof(result));
+    _exit(0);
+  }
+  double result[3] = {};
+  REQUIRE(read(fds[0], result, sizeof(result)) == sizeof(result));
+  waitpid(pid, nullptr, 0);
+  close(fds[0]);
+  close(fds[1]);
+  REQUIRE(result[2] > 0);
+  printf("  %s: first event %.0f ms, loaded %.0f ms, peak RSS %.1f MB\n", name, result[0], result[1], result[2]);
+}
+
+TEST_CASE("LogReader benchmark", "[.][benchmark]") {
+  // the cached file is read like a local rlog.bz2
+  FileReader(true).read(TEST_RLOG_URL);
+  const std::string file = "/tmp/test_replay_bench_rlog.bz2";
+  std::string content = util::read_file(cacheFilePath(TEST_RLOG_URL));
+  util::write_file(file.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT | O_TRUNC);
+  std::string().swap(content);  // not part of the children's RSS
+
+  printf("%s\n", TEST_RLOG_URL.c_str());
+  bench_load("decompress, then parse", [&](auto on_events) {
+    std::string raw = decompressBZ2(util::read_file(file));
+    LogReader log;
+    bool ret = log.load((std::byte *)raw.data(), raw.size());
+    on_events();
+    return ret;
+  });
+  bench_load("streamed", [&](auto on_events) {
+    LogReader log;
+    log.setChunkCallback([&](auto &, size_t) { on_events(); });
+    return log.load(file);
+  });
 }
 
 void read_segment(int n, const SegmentFile &segment_file, uint32_t flags) {
@@ -87,6 +381,11 @@ void read_segment(int n, const SegmentFile &segment_file, uint32_t flags) {
     // test LogReader & FrameReader
     REQUIRE(segment.log->events.size() > 0);
     REQUIRE(std::is_sorted(segment.log->events.begin(), segment.log->events.end(), Event::lessThan()));
+    size_t memory = segment.log->memoryUsage();
+    for (auto &fr : segment.frames) {
+      if (fr) memory += fr->memoryUsage();
+    }
+    REQUIRE(segment.memoryUsage() == memory);
 
     for (auto cam : ALL_CAMERAS) {
       auto &fr = segment.frames[cam];
@@ -95,6 +394,7 @@ void read_segment(int n, const SegmentFile &segment_file, uint32_t flags) {
       if (cam == RoadCam || cam == WideRoadCam) {
         REQUIRE(fr->getFrameCount() == 1200);
       }
+      REQUIRE(fr->memoryUsage() > fr->getFrameCount() * sizeof(AVPacket));
       std::unique_ptr<uint8_t[]> yuv_buf = std::make_unique<uint8_t[]>(fr->getYUVSize());
       // sequence get 100 frames
       for (int i = 0; i < 100; ++i) {
@@ -107,6 +407,38 @@ void read_segment(int n, const SegmentFile &segment_file, uint32_t flags) {
   loop.exec();
 }
 
+TEST_CASE("LogReader route benchmark", "[.][benchmark]") {
+  // a 10 segment route of uncompressed rlogs
+  const int segment_cnt = 10;
+  std::string content = decompressBZ2(FileReader(true).read(TEST_RLOG_URL));
+  std::vector<std::string> files;
+  for (int i = 0; i < segment_cnt; ++i) {
+    files.push_back(util::string_format("/tmp/test_replay_bench_route--%d/rlog", i));
+    util::create_directories(util::dir_name(files.back()), 0755);
+    util::write_file(files.back().c_str(), content.data(), content.size(), O_WRONLY | O_CREAT | O_TRUNC);
+  }
+
+  printf("%d segments, %zu MB of rlogs, %zu bytes per event\n", segment_cnt, content.size() * segment_cnt / 1000000, sizeof(Event));
+  std::string().swap(content);
+  bench_load("copied", [&](auto on_events) {
+    std::vector<std::unique_ptr<LogReader>> logs;
+    for (auto &file : files) {
+      std::string raw = util::read_file(file);
+      if (!logs.emplace_back(std::make_unique<LogReader>())->load((std::byte *)raw.data(), raw.size())) return false;
+      on_events();
+    }
+    return true;
+  });
+  bench_load("mapped", [&](auto on_events) {
+    std::vector<std::unique_ptr<LogReader>> logs;
+    for (auto &file : files) {
+      if (!logs.emplace_back(std::make_unique<LogReader>())->load(file)) return false;
+      on_events();
+    }
+    return true;
+  });
+}
+
 TEST_CASE("Route") {
   // Create a local route from remote for testing
   Route remote_route(DEMO_ROUTE);
@@ -150,6 +482,17 @@ class TestReplay : public Replay {
   TestReplay(const QString &route, uint32_t flags = REPLAY_FLAG_NO_FILE_CACHE | REPLAY_FLAG_NO_VIPC) : Replay(route, {}, {}, {}, nullptr, flags) {}
   void test_seek();
   void testSeekTo(int seek_to);
+  void test_concurrent_loads();
+  void test_memory_limit();
+  void test_timeline();
+  // segments with a Segment, loaded or not
+  std::set<int> queued() const {
+    std::set<int> ret;
+    for (auto &[n, seg] : segments_) {
+      if (seg) ret.insert(n);
+    }
+    return ret;
+  }
 };
 
 void TestReplay::testSeekTo(int seek_to) {
@@ -199,8 +542,135 @@ void TestReplay::test_seek() {
   thread.join();
 }
 
+void TestReplay::test_concurrent_loads() {
+  // a dummy stream thread. without an event loop loadFinished isn't handled, nothing else gets queued
+  stream_thread_ = new QThread(this);
+  setSegmentCacheLimit(MIN_SEGMENTS_CACHE);
+  setConcurrentLoads(2);
+
+  // the current segment, then forward
+  seekTo(6 * 60, false);
+  REQUIRE(queued() == std::set<int>{6, 7});
+
+  // at the end of the route the window is before the current segment, the loads of 6 and 7 are cancelled
+  seekTo(12 * 60, false);
+  REQUIRE(queued() == std::set<int>{11, 12});
+
+  // a seek within the window cancels the loads that were overtaken, unless they already finished
+  seekTo(9 * 60, false);
+  auto segments = queued();
+  REQUIRE(segments.count(9) == 1);
+  REQUIRE(segments.count(10) == 1);
+  REQUIRE(segments.count(12) == 0);
+  REQUIRE((segments.count(11) == 0 || segments_[11]->isLoaded()));
+}
+
+void TestReplay::test_memory_limit() {
+  // a dummy stream thread, queueSegment() is called by the test once the loads finished
+  stream_thread_ = new QThread(this);
+  setSegmentCacheLimit(MIN_SEGMENTS_CACHE);
+  setConcurrentLoads(MIN_SEGMENTS_CACHE);
+  auto wait_loaded = [this]() {
+    for (auto &[n, seg] : segments_) {
+      while (seg && !seg->isLoaded()) util::sleep_for(20);
+    }
+  };
+
+  // the window is 4-8, in load order 6, 7, 8, 5, 4
+  seekTo(6 * 60, false);
+  REQUIRE(queued() == std::set<int>{4, 5, 6, 7, 8});
+  wait_loaded();
+  const size_t memory = segments_[6]->memoryUsage() + segments_[7]->memoryUsage() + segments_[8]->memoryUsage();
+
+  // segment 8 doesn't fit by one byte
+  setCacheMemoryLimit(memory - 1);
+  queueSegment();
+  REQUIRE(queued() == std::set<int>{6, 7});
+
+  // the evicted segments are estimated at their measured size, they aren't reloaded
+  queueSegment();
+  REQUIRE(queued() == std::set<int>{6, 7});
+
+  // until there is room for them
+  setCacheMemoryLimit(memory);
+  queueSegment();
+  REQUIRE(queued() == std::set<int>{6, 7, 8});
+}
+
+void TestReplay::test_timeline() {
+  unlink(timelineCachePath().c_str());
+
+  // controlsState at 1Hz for two segments, engaged from 10s to 70s with a warning from 20s to 25s. a user flag at 30s
+  std::vector<kj::Array<capnp::word>> msgs;
+  std::vector<Event> events[2];
+  for (int sec = 0; sec < 120; ++sec) {
+    capnp::MallocMessageBuilder builder;
+    auto cs = builder.initRoot<cereal::Event>().initControlsState();
+    cs.setEnabled(sec >= 10 && sec < 70);
+    if (sec >= 20 && sec < 25) {
+      cs.setAlertType("warning");
+      cs.setAlertStatus(cereal::ControlsState::AlertStatus::USER_PROMPT);
+      cs.setAlertSize(cereal::ControlsState::AlertSize::MID);
+    }
+    msgs.push_back(capnp::messageToFlatArray(builder));
+    events[sec / 60].emplace_back(cereal::Event::CONTROLS_STATE, sec * 1e9, msgs.back());
+    if (sec == 30) {
+      capnp::MallocMessageBuilder flag_builder;
+      flag_builder.initRoot<cereal::Event>().initUserFlag();
+      msgs.push_back(capnp::messageToFlatArray(flag_builder));
+      events[0].emplace_back(cereal::Event::USER_FLAG, sec * 1e9, msgs.back());
+    }
+  }
+  auto add_segment = [&](int n) {
+    std::vector<Event *> ptrs;
+    for (auto &e : events[n]) ptrs.push_back(&e);
+    addTimelineSegment(n, ptrs);
+    updateTimeline();
+  };
+
+  // the timeline only covers the segments that were loaded
+  add_segment(1);
+  REQUIRE(getTimeline() == std::vector<std::tuple<double, double, TimelineType>>{{60, 70, TimelineType::Engaged}});
+
+  add_segment(0);
+  const std::vector<std::tuple<double, double, TimelineType>> expected = {
+    {10, 70, TimelineType::Engaged},
+    {20, 25, TimelineType::AlertWarning},
+    {30, 30, TimelineType::UserFlag},
+  };
+  REQUIRE(getTimeline() == expected);
+
+  // reopening the route reads the timeline from the cache
+  saveTimelineCache();
+  TestReplay reopened(route_->name());
+  REQUIRE(reopened.loadTimelineCache());
+  reopened.updateTimeline();
+  REQUIRE(reopened.getTimeline() == expected);
+
+  // a corrupt cache is ignored
+  std::string cache = util::read_file(timelineCachePath());
+  util::write_file(timelineCachePath().c_str(), cache.data(), cache.size() - 1, O_WRONLY | O_CREAT | O_TRUNC);
+  TestReplay corrupt(route_->name());
+  REQUIRE(!corrupt.loadTimelineCache());
+  REQUIRE(corrupt.timeline_segments_.empty());
+  unlink(timelineCachePath().c_str());
+}
+
+TEST_CASE("Replay timeline") {
+  TestReplay replay("0000000000000000|2000-01-01--00-00-00");
+  replay.test_timeline();
+}
+
 TEST_CASE("Replay") {
   TestReplay replay(DEMO_ROUTE);
   REQUIRE(replay.load());
-  replay.test_seek();
+  SECTION("seek") {
+    replay.test_seek();
+  }
+  SECTION("concurrent loads") {
+    replay.test_concurrent_loads();
+  }
+  SECTION("memory limit") {
+    replay.test_memory_limit();
+  }
 }
@@ -3,14 +3,22 @@
 #include <bzlib.h>
 #include <curl/curl.h>
 #include <openssl/sha.h>
+#include <zstd.h>
 
+#include <algorithm>
+#include <array>
 #include <cstring>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
 #include <mutex>
 #include <numeric>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "common/timing.h"
 #include "common/util.h"
@@ -257,41 +265,316 @@ std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort) {
 }
 
 std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool> *abort) {
-  if (in_size == 0) return {};
+  std::string out;
+  out.reserve(in_size * 5);
+  auto append = [&](const char *data, size_t size) {
+    out.append(data, size);
+    return true;
+  };
+  return decompressBZ2Parallel(in, in_size, append, abort) ? out : "";
+}
+
+namespace {
+
+// every bz2 block starts with a 48 bit magic, followed by the block's crc. blocks are bit aligned,
+// the last one of a stream is followed by the end of stream magic and the stream's combined crc.
+const uint64_t BZ2_BLOCK_MAGIC = 0x314159265359;
+const uint64_t BZ2_EOS_MAGIC = 0x177245385090;
+
+// bit ranges of the blocks, each one ends where the next magic begins
+std::vector<std::pair<size_t, size_t>> findBZ2Blocks(const uint8_t *in, size_t size) {
+  std::vector<std::pair<size_t, size_t>> blocks;
+  if (size < 4 || memcmp(in, "BZh", 3) != 0) return blocks;
+
+  // a magic that ends in byte i, at any shift, covers all of byte i - 1
+  static const auto candidates = []() {
+    std::array<bool, 256> table = {};
+    for (uint64_t magic : {BZ2_BLOCK_MAGIC, BZ2_EOS_MAGIC}) {
+      for (int shift = 0; shift < 8; ++shift) table[(magic >> (8 - shift)) & 0xff] = true;
+    }
+    return table;
+  }();
+
+  uint64_t window = 0;
+  for (size_t i = 0; i < size; ++i) {
+    window = (window << 8) | in[i];
+    if (i < 5 || !candidates[in[i - 1]]) continue;
+    for (int shift = 7; shift >= 0; --shift) {
+      const uint64_t bits = (window >> shift) & 0xffffffffffff;
+      if (bits != BZ2_BLOCK_MAGIC && bits != BZ2_EOS_MAGIC) continue;
+
+      const size_t pos = (i + 1) * 8 - shift - 48;
+      if (!blocks.empty() && blocks.back().second == 0) blocks.back().second = pos;
+      if (bits == BZ2_BLOCK_MAGIC) blocks.push_back({pos, 0});
+    }
+  }
+  if (!blocks.empty() && blocks.back().second == 0) blocks.back().second = size * 8;
+  return blocks;
+}
+
+class BitWriter {
+public:
+  void write(uint64_t bits, int n) {
+    while (n > 0) {
+      const int cnt = std::min(n, 8 - used_);
+      const uint8_t v = (bits >> (n - cnt)) & ((1 << cnt) - 1);
+      if (used_ == 0) out.push_back(0);
+      out.back() |= v << (8 - used_ - cnt);
+      used_ = (used_ + cnt) % 8;
+      n -= cnt;
+    }
+  }
+  std::string out;
+
+private:
+  int used_ = 0;
+};
+
+// the bits [begin, end) of in, which are at most 64 bits
+uint64_t readBits(const uint8_t *in, size_t begin, size_t end) {
+  uint64_t bits = 0;
+  for (size_t pos = begin; pos < end; ++pos) {
+    bits = (bits << 1) | ((in[pos / 8] >> (7 - pos % 8)) & 1);
+  }
+  return bits;
+}
+
+// decodes one block as a stream of its own. the combined crc of a single block stream is the block's crc.
+bool decodeBZ2Block(const uint8_t *in, size_t size, std::pair<size_t, size_t> block, std::string &out) {
+  const size_t begin = block.first, end = block.second;
+  if (end - begin < 80) return false;
+
+  BitWriter stream;
+  stream.out.reserve((end - begin) / 8 + 16);
+  stream.write('B', 8), stream.write('Z', 8), stream.write('h', 8), stream.write('9', 8);
+  // the header is byte aligned, the block is shifted into place a byte at a time
+  const int shift = begin % 8;
+  size_t pos = begin;
+  for (; pos + 8 <= end; pos += 8) {
+    const size_t i = pos / 8;
+    stream.out.push_back(shift == 0 ? in[i] : (in[i] << shift) | (in[i + 1] >> (8 - shift)));
+  }
+  stream.write(readBits(in, pos, end), end - pos);
+  stream.write(BZ2_EOS_MAGIC, 48);
+  stream.write(readBits(in, begin + 48, begin + 80), 32);
 
   bz_stream strm = {};
   int bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
   assert(bzerror == BZ_OK);
-
-  strm.next_in = (char *)in;
-  strm.avail_in = in_size;
-  std::string out(in_size * 5, '\0');
+  strm.next_in = stream.out.data();
+  strm.avail_in = stream.out.size();
+  out.resize(stream.out.size() * 5);
   do {
-    strm.next_out = (char *)(&out[strm.total_out_lo32]);
+    if (strm.total_out_lo32 == out.size()) out.resize(out.size() * 2);
+    strm.next_out = &out[strm.total_out_lo32];
     strm.avail_out = out.size() - strm.total_out_lo32;
-
     const char *prev_write_pos = strm.next_out;
     bzerror = BZ2_bzDecompress(&strm);
-    if (bzerror == BZ_OK && prev_write_pos == strm.next_out) {
-      // content is corrupt
-      bzerror = BZ_STREAM_END;
-      rWarning("decompressBZ2 error : content is corrupt");
+    if (bzerror == BZ_OK && prev_write_pos == strm.next_out) break;  // truncated
+  } while (bzerror == BZ_OK);
+  out.resize(strm.total_out_lo32);
+  BZ2_bzDecompressEnd(&strm);
+  return bzerror == BZ_STREAM_END;
+}
+
+// decompresses in with a single stream, the first skip bytes of the output were already handed out
+bool decompressBZ2Serial(const std::byte *in, size_t in_size, const std::function<bool(const char *, size_t)> &callback,
+                         std::atomic<bool> *abort, size_t skip) {
+  if (in_size == 0) return false;
+
+  StreamDecompressor decompressor(StreamDecompressor::Type::BZ2);
+  std::string buf(1024 * 1024, '\0');
+  while (!decompressor.finished() && !(abort && *abort)) {
+    const size_t prev_in_size = in_size;
+    ssize_t n = decompressor.decompress(&in, &in_size, (std::byte *)buf.data(), buf.size());
+    if (n < 0) return false;
+    if (n == 0 && in_size == prev_in_size && !decompressor.finished()) {
+      rWarning("decompressBZ2 error : content is truncated");
       break;
     }
+    const size_t skipped = std::min<size_t>(skip, n);
+    skip -= skipped;
+    if (n > skipped && !callback(buf.data() + skipped, n - skipped)) break;
+  }
+  return !(abort && *abort);
+}
 
-    if (bzerror == BZ_OK && strm.avail_in > 0 && strm.avail_out == 0) {
-      out.resize(out.size() * 2);
+}  // namespace
+
+bool decompressBZ2Parallel(const std::byte *in, size_t in_size, const std::function<bool(const char *data, size_t size)> &callback,
+                           std::atomic<bool> *abort, int threads) {
+  const uint8_t *data = (const uint8_t *)in;
+  const auto blocks = findBZ2Blocks(data, in_size);
+  if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  if (threads == 1 || blocks.size() < 2) {
+    return decompressBZ2Serial(in, in_size, callback, abort, 0);
+  }
+
+  // workers decode at most 2 blocks per thread ahead of the one that's handed out
+  struct Result {
+    std::string out;
+    bool done = false;
+    bool ok = false;
+  };
+  std::vector<Result> results(blocks.size());
+  std::mutex lock;
+  std::condition_variable cv;
+  size_t next_block = 0, next_out = 0;
+  bool stop = false;
+  auto worker = [&]() {
+    while (true) {
+      size_t i = 0;
+      {
+        std::unique_lock lk(lock);
+        cv.wait(lk, [&]() { return stop || next_block == blocks.size() || next_block < next_out + threads * 2; });
+        if (stop || next_block == blocks.size()) return;
+        i = next_block++;
+      }
+      std::string out;
+      bool ok = decodeBZ2Block(data, in_size, blocks[i], out);
+      {
+        std::lock_guard lk(lock);
+        results[i] = {.out = std::move(out), .done = true, .ok = ok};
+      }
+      cv.notify_all();
     }
-  } while (bzerror == BZ_OK && !(abort && *abort));
+  };
+  std::vector<std::thread> workers;
+  for (int i = 0; i < std::min<int>(threads, blocks.size()); ++i) {
+    workers.emplace_back(worker);
+  }
 
-  BZ2_bzDecompressEnd(&strm);
-  if (bzerror == BZ_STREAM_END && !(abort && *abort)) {
-    out.resize(strm.total_out_lo32);
+  size_t delivered = 0;
+  bool failed = false, done = false;
+  while (!failed && !done && next_out < blocks.size() && !(abort && *abort)) {
+    std::string out;
+    {
+      std::unique_lock lk(lock);
+      cv.wait_for(lk, std::chrono::milliseconds(100), [&]() { return results[next_out].done; });
+      if (!results[next_out].done) continue;
+      failed = !results[next_out].ok;
+      out = std::move(results[next_out++].out);
+    }
+    cv.notify_all();
+    if (!failed) {
+      done = !callback(out.data(), out.size());
+      delivered += out.size();
+    }
+  }
+  {
+    std::lock_guard lk(lock);
+    stop = true;
+  }
+  cv.notify_all();
+  for (auto &t : workers) t.join();
+
+  if (abort && *abort) return false;
+  if (failed) {
+    // e.g. a truncated block, or a magic that's part of the compressed data
+    return decompressBZ2Serial(in, in_size, callback, abort, delivered);
+  }
+  return true;
+}
+
+std::string decompressZST(const std::string &in, std::atomic<bool> *abort) {
+  return decompressZST((std::byte *)in.data(), in.size(), abort);
+}
+
+std::string decompressZST(const std::byte *in, size_t in_size, std::atomic<bool> *abort) {
+  if (in_size == 0) return {};
+
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  assert(dctx != nullptr);
+
+  // loggerd writes a single streamed frame without the content size
+  unsigned long long content_size = ZSTD_getFrameContentSize(in, in_size);
+  std::string out(content_size < ZSTD_CONTENTSIZE_ERROR ? content_size : in_size * 5, '\0');
+  ZSTD_inBuffer input = {.src = in, .size = in_size, .pos = 0};
+  ZSTD_outBuffer output = {.dst = out.data(), .size = out.size(), .pos = 0};
+  size_t ret = 0;
+  do {
+    if (output.pos == output.size) {
+      out.resize(std::max(out.size() * 2, in_size));
+      output.dst = out.data();
+      output.size = out.size();
+    }
+    ret = ZSTD_decompressStream(dctx, &output, &input);
+    if (ZSTD_isError(ret)) {
+      rWarning("decompressZST error : %s", ZSTD_getErrorName(ret));
+      break;
+    }
+    // a full output buffer may hold back data even if all input is consumed
+  } while ((input.pos < input.size || output.pos == output.size) && !(abort && *abort));
+
+  ZSTD_freeDCtx(dctx);
+  if (ret == 0 && !(abort && *abort)) {
+    out.resize(output.pos);
     return out;
   }
+  if (!ZSTD_isError(ret)) {
+    rWarning("decompressZST error : content is truncated");
+  }
   return {};
 }
 
+// class StreamDecompressor
+
+StreamDecompressor::StreamDecompressor(Type type) : type_(type) {
+  if (type_ == Type::BZ2) {
+    bz_stream *strm = new bz_stream{};
+    int bzerror = BZ2_bzDecompressInit(strm, 0, 0);
+    assert(bzerror == BZ_OK);
+    ctx_ = strm;
+  } else {
+    ctx_ = ZSTD_createDCtx();
+    assert(ctx_ != nullptr);
+  }
+}
+
+StreamDecompressor::~StreamDecompressor() {
+  if (type_ == Type::BZ2) {
+    BZ2_bzDecompressEnd((bz_stream *)ctx_);
+    delete (bz_stream *)ctx_;
+  } else {
+    ZSTD_freeDCtx((ZSTD_DCtx *)ctx_);
+  }
+}
+
+ssize_t StreamDecompressor::decompress(const std::byte **in, size_t *in_size, std::byte *out, size_t out_size) {
+  if (finished_) return 0;
+
+  size_t consumed = 0, written = 0;
+  if (type_ == Type::BZ2) {
+    bz_stream *strm = (bz_stream *)ctx_;
+    strm->next_in = (char *)*in;
+    strm->avail_in = *in_size;
+    strm->next_out = (char *)out;
+    strm->avail_out = out_size;
+    int bzerror = BZ2_bzDecompress(strm);
+    if (bzerror != BZ_OK && bzerror != BZ_STREAM_END) {
+      rWarning("decompressBZ2 error : content is corrupt");
+      return -1;
+    }
+    finished_ = bzerror == BZ_STREAM_END;
+    consumed = *in_size - strm->avail_in;
+    written = out_size - strm->avail_out;
+  } else {
+    ZSTD_inBuffer input = {.src = *in, .size = *in_size, .pos = 0};
+    ZSTD_outBuffer output = {.dst = out, .size = out_size, .pos = 0};
+    size_t ret = ZSTD_decompressStream((ZSTD_DCtx *)ctx_, &output, &input);
+    if (ZSTD_isError(ret)) {
+      rWarning("decompressZST error : %s", ZSTD_getErrorName(ret));
+      return -1;
+    }
+    finished_ = ret == 0;
+    consumed = input.pos;
+    written = output.pos;
+  }
+  *in += consumed;
+  *in_size -= consumed;
+  return written;
+}
+
 void precise_nano_sleep(long sleep_ns) {
   const long estimate_ns = 1 * 1e6;  // 1ms
   struct timespec req = {.tv_nsec = estimate_ns};
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <sys/types.h>
+
 #include <atomic>
+#include <cstddef>
 #include <functional>
 #include <string>
 
@@ -24,6 +27,32 @@ std::string sha256(const std::string &str);
 void precise_nano_sleep(long sleep_ns);
 std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort = nullptr);
 std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool> *abort = nullptr);
+// decodes the blocks of bz2 content on threads (all cores if 0), the output is handed to callback in order
+// until it returns false. everything from a block that doesn't decode on its own (e.g. the truncated last
+// one) is decompressed serially. returns false if the content is corrupt or it was aborted.
+bool decompressBZ2Parallel(const std::byte *in, size_t in_size, const std::function<bool(const char *data, size_t size)> &callback,
+                           std::atomic<bool> *abort = nullptr, int threads = 0);
+std::string decompressZST(const std::string &in, std::atomic<bool> *abort = nullptr);
+std::string decompressZST(const std::byte *in, size_t in_size, std::atomic<bool> *abort = nullptr);
+
+// decompresses a bz2 or zstd stream piece by piece, so the whole output doesn't have to be in memory at once
+class StreamDecompressor {
+public:
+  enum class Type { BZ2, ZST };
+  StreamDecompressor(Type type);
+  ~StreamDecompressor();
+  // decompresses as much of the in_size bytes at *in as fits into out, *in and *in_size are advanced past
+  // the consumed input. returns the number of bytes written to out, -1 if the content is corrupt.
+  ssize_t decompress(const std::byte **in, size_t *in_size, std::byte *out, size_t out_size);
+  // the end of the stream was reached
+  inline bool finished() const { return finished_; }
+
+private:
+  const Type type_;
+  void *ctx_ = nullptr;
+  bool finished_ = false;
+};
+
 std::string getUrlWithoutQuery(const std::string &url);
 size_t getRemoteFileSize(const std::string &url, std::atomic<bool> *abort = nullptr);
 std::string httpGet(const std::string &url, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);